@@ -0,0 +1,210 @@
+/**
+ * aps.c - APS data queues between ZBOSS and the deCONZ host
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.*
+ */
+
+#include "aps.h"
+
+#include <string.h>
+
+#include "nrf_log.h"
+
+#include "device_state.h"
+
+// Indications are put in by the ZBOSS endpoint handler and taken out by
+// the APS_DATA_INDICATION handler. Both run from the main loop, so the
+// queue needs no locking. Slots are fixed size so that a burst of
+// attribute reports never has to wait for memory.
+static ApsIndication_t m_indication[APS_INDICATION_QUEUE_SIZE];
+static size_t m_indicationTail;   // oldest queued indication
+static size_t m_indicationCount;
+static ApsIndicationStats_t m_indicationStats;
+
+static inline size_t IndicationIndex(size_t offset) {
+  size_t idx = m_indicationTail + offset;
+  return idx >= APS_INDICATION_QUEUE_SIZE ? idx - APS_INDICATION_QUEUE_SIZE : idx;
+}
+
+ApsIndication_t *ApsIndicationAlloc(void) {
+  ApsIndication_t *ind = NULL;
+
+  m_indicationStats.received++;
+  if (m_indicationCount >= APS_INDICATION_QUEUE_SIZE) {
+    m_indicationStats.dropped++;
+    if (APS_INDICATION_DROP_OLDEST) {
+      // Make room by losing the oldest, whose slot becomes the new head.
+      m_indicationTail = IndicationIndex(1);
+      m_indicationCount--;
+    }
+  }
+  if (m_indicationCount < APS_INDICATION_QUEUE_SIZE) {
+    ind = &m_indication[IndicationIndex(m_indicationCount)];
+  }
+
+  if (ind == NULL) {
+    NRF_LOG_WARNING("APS indication dropped - queue full");
+  }
+  return ind;
+}
+
+void ApsIndicationCommit(void) {
+  m_indicationCount++;
+  if (m_indicationCount > m_indicationStats.highWater) {
+    m_indicationStats.highWater = m_indicationCount;
+  }
+  DeviceStateSetFlag(DEVICE_STATE_APS_DATA_INDICATION, 1);
+}
+
+void ApsIndicationOversize(void) {
+  m_indicationStats.oversize++;
+}
+
+const ApsIndication_t *ApsIndicationPeek(void) {
+  if (m_indicationCount == 0) {
+    return NULL;
+  }
+  return &m_indication[m_indicationTail];
+}
+
+void ApsIndicationFree(void) {
+  if (m_indicationCount > 0) {
+    m_indicationTail = IndicationIndex(1);
+    m_indicationCount--;
+    m_indicationStats.delivered++;
+  }
+  DeviceStateSetFlag(DEVICE_STATE_APS_DATA_INDICATION, m_indicationCount > 0);
+}
+
+size_t ApsIndicationCount(void) {
+  return m_indicationCount;
+}
+
+ApsIndicationStats_t *ApsIndicationGetStats(void) {
+  return &m_indicationStats;
+}
+
+void ApsIndicationResetStats(void) {
+  memset(&m_indicationStats, 0, sizeof(m_indicationStats));
+}
+
+// Requests are put in by the packet handlers and sent and confirmed
+// by the main loop. Confirms can come back in a different order to the
+// one the requests went out in (different destinations take different
+// routes), so they're kept in their own ring of slot numbers.
+static ApsRequest_t m_request[APS_REQUEST_QUEUE_SIZE];
+static size_t m_requestsInUse;
+static uint32_t m_requestOrder;
+static uint8_t m_confirm[APS_REQUEST_QUEUE_SIZE];
+static size_t m_confirmTail;
+static size_t m_confirmCount;
+static ApsRequestStats_t m_requestStats;
+
+static inline size_t ConfirmIndex(size_t offset) {
+  size_t idx = m_confirmTail + offset;
+  return idx >= APS_REQUEST_QUEUE_SIZE ? idx - APS_REQUEST_QUEUE_SIZE : idx;
+}
+
+static void UpdateRequestFlags(void) {
+  DeviceStateSetFlag(DEVICE_STATE_APS_DATA_REQUEST, m_requestsInUse < APS_REQUEST_QUEUE_SIZE);
+  DeviceStateSetFlag(DEVICE_STATE_APS_DATA_CONFIRM, m_confirmCount > 0);
+}
+
+ApsRequest_t *ApsRequestAlloc(void) {
+  ApsRequest_t *req = NULL;
+
+  for (size_t i = 0; i < APS_REQUEST_QUEUE_SIZE; i++) {
+    if (m_request[i].state == APS_REQUEST_FREE) {
+      req = &m_request[i];
+      break;
+    }
+  }
+  if (req == NULL) {
+    m_requestStats.busy++;
+  }
+  return req;
+}
+
+void ApsRequestSubmit(ApsRequest_t *req) {
+  req->state = APS_REQUEST_PENDING;
+  req->order = m_requestOrder++;
+  m_requestsInUse++;
+  m_requestStats.submitted++;
+  if (m_requestsInUse > m_requestStats.highWater) {
+    m_requestStats.highWater = m_requestsInUse;
+  }
+  UpdateRequestFlags();
+
+  ApsRequestReady();
+}
+
+ApsRequest_t *ApsRequestNextPending(void) {
+  ApsRequest_t *req = NULL;
+
+  for (size_t i = 0; i < APS_REQUEST_QUEUE_SIZE; i++) {
+    if (m_request[i].state == APS_REQUEST_PENDING &&
+        (req == NULL || (int32_t)(m_request[i].order - req->order) < 0)) {
+      req = &m_request[i];
+    }
+  }
+  if (req != NULL) {
+    req->state = APS_REQUEST_SENT;
+  }
+  return req;
+}
+
+void ApsRequestConfirm(ApsRequest_t *req, uint8_t status) {
+  req->state = APS_REQUEST_CONFIRMED;
+  req->confirmStatus = status;
+  m_confirm[ConfirmIndex(m_confirmCount)] = ApsRequestIndex(req);
+  m_confirmCount++;
+  m_requestStats.confirmed++;
+  if (status != APS_STATUS_SUCCESS) {
+    m_requestStats.failed++;
+  }
+  UpdateRequestFlags();
+}
+
+size_t ApsRequestIndex(const ApsRequest_t *req) {
+  return req - m_request;
+}
+
+ApsRequest_t *ApsRequestGet(size_t idx) {
+  return &m_request[idx];
+}
+
+const ApsRequest_t *ApsConfirmPeek(void) {
+  if (m_confirmCount == 0) {
+    return NULL;
+  }
+  return &m_request[m_confirm[m_confirmTail]];
+}
+
+void ApsConfirmFree(void) {
+  if (m_confirmCount > 0) {
+    m_request[m_confirm[m_confirmTail]].state = APS_REQUEST_FREE;
+    m_confirmTail = ConfirmIndex(1);
+    m_confirmCount--;
+    m_requestsInUse--;
+    m_requestStats.delivered++;
+  }
+  UpdateRequestFlags();
+}
+
+size_t ApsConfirmCount(void) {
+  return m_confirmCount;
+}
+
+size_t ApsRequestFreeSlots(void) {
+  return APS_REQUEST_QUEUE_SIZE - m_requestsInUse;
+}
+
+ApsRequestStats_t *ApsRequestGetStats(void) {
+  return &m_requestStats;
+}
+
+void ApsRequestResetStats(void) {
+  memset(&m_requestStats, 0, sizeof(m_requestStats));
+}
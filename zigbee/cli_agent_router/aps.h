@@ -0,0 +1,170 @@
+/**
+ * aps.h - APS data queues between ZBOSS and the deCONZ host
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.*
+ */
+
+#if !defined(APS_H)
+#define APS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sdk_config.h"
+#include "zboss_api.h"
+
+// See pca10056/blank/config/sdk_config.h
+#if !defined(APS_INDICATION_QUEUE_SIZE)
+#define APS_INDICATION_QUEUE_SIZE 8
+#endif
+
+#if !defined(APS_INDICATION_MAX_ASDU)
+#define APS_INDICATION_MAX_ASDU   80
+#endif
+
+#if !defined(APS_INDICATION_DROP_OLDEST)
+#define APS_INDICATION_DROP_OLDEST 1
+#endif
+
+#if !defined(APS_REQUEST_QUEUE_SIZE)
+#define APS_REQUEST_QUEUE_SIZE    4
+#endif
+
+#if !defined(APS_REQUEST_MAX_ASDU)
+#define APS_REQUEST_MAX_ASDU      82
+#endif
+
+// APS status codes reported by APS_DATA_CONFIRM
+#define APS_STATUS_SUCCESS    0x00
+#define APS_STATUS_NO_ACK     0xa7
+
+// deCONZ address modes
+#define APS_ADDR_MODE_GROUP     0x01
+#define APS_ADDR_MODE_NWK       0x02
+#define APS_ADDR_MODE_IEEE      0x03
+#define APS_ADDR_MODE_NWK_IEEE  0x04  // both (source address only)
+
+typedef struct {
+  uint8_t         dstAddrMode;  // APS_ADDR_MODE_NWK or APS_ADDR_MODE_GROUP
+  uint16_t        dstAddr16;  // short address or group
+  uint8_t         dstEndpoint;
+  uint8_t         srcAddrMode;
+  uint16_t        srcAddr16;
+  zb_ieee_addr_t  srcAddr64;
+  uint8_t         srcEndpoint;
+  uint16_t        profileId;
+  uint16_t        clusterId;
+  uint8_t         lqi;
+  int8_t          rssi;
+  uint16_t        asduLen;
+  uint8_t         asdu[APS_INDICATION_MAX_ASDU];
+} ApsIndication_t;
+
+typedef struct {
+  uint32_t  received;   // indications passed to ApsIndicationAlloc
+  uint32_t  delivered;  // indications read by a host
+  uint32_t  dropped;    // indications lost because the queue was full
+  uint32_t  oversize;   // indications with more than APS_INDICATION_MAX_ASDU bytes
+  uint16_t  highWater;  // most indications queued at once
+} ApsIndicationStats_t;
+
+// The indication queue is filled from the ZBOSS endpoint handler and
+// drained by APS_DATA_INDICATION requests. While it isn't empty
+// DEVICE_STATE_APS_DATA_INDICATION is set in the device state.
+//
+// ApsIndicationAlloc returns the slot for a new indication, or NULL if
+// the queue is full and APS_INDICATION_DROP_OLDEST isn't set (in which
+// case the new indication is the one which gets dropped). Once the slot
+// has been filled in, ApsIndicationCommit makes it visible to the hosts.
+ApsIndication_t *ApsIndicationAlloc(void);
+void ApsIndicationCommit(void);
+
+// Counts an indication which was too big to queue.
+void ApsIndicationOversize(void);
+
+// Returns the oldest queued indication (or NULL if there aren't any),
+// which stays valid until ApsIndicationFree is called.
+const ApsIndication_t *ApsIndicationPeek(void);
+void ApsIndicationFree(void);
+
+size_t ApsIndicationCount(void);
+
+ApsIndicationStats_t *ApsIndicationGetStats(void);
+void ApsIndicationResetStats(void);
+
+typedef enum {
+  APS_REQUEST_FREE,
+  APS_REQUEST_PENDING,    // waiting for the main loop to hand it to ZBOSS
+  APS_REQUEST_SENT,       // waiting for ZBOSS to confirm it
+  APS_REQUEST_CONFIRMED,  // waiting for the host to read the confirm
+} ApsRequestState_t;
+
+typedef struct {
+  ApsRequestState_t state;
+  uint32_t        order;        // submission order, oldest first
+  uint8_t         requestId;    // chosen by the host
+  uint8_t         dstAddrMode;  // APS_ADDR_MODE_GROUP, _NWK or _IEEE
+  uint16_t        dstAddr16;    // short address or group
+  zb_ieee_addr_t  dstAddr64;
+  uint8_t         dstEndpoint;
+  uint8_t         srcEndpoint;
+  uint16_t        profileId;
+  uint16_t        clusterId;
+  uint8_t         txOptions;
+  uint8_t         radius;
+  uint8_t         confirmStatus;  // APS_STATUS_xxx
+  uint16_t        asduLen;
+  uint8_t         asdu[APS_REQUEST_MAX_ASDU];
+} ApsRequest_t;
+
+typedef struct {
+  uint32_t  submitted;  // requests accepted from a host
+  uint32_t  busy;       // requests turned away because every slot was in use
+  uint32_t  confirmed;  // confirms received from ZBOSS
+  uint32_t  failed;     // confirms with a status other than APS_STATUS_SUCCESS
+  uint32_t  delivered;  // confirms read by a host
+  uint16_t  highWater;  // most slots in use at once
+} ApsRequestStats_t;
+
+// APS_DATA_REQUESTs occupy one of APS_REQUEST_QUEUE_SIZE slots from
+// the time they're accepted until the host has read their confirm, so
+// a host can have that many in flight. DEVICE_STATE_APS_DATA_REQUEST
+// is set while there's a free slot, and DEVICE_STATE_APS_DATA_CONFIRM
+// while there's a confirm to be read.
+//
+// ApsRequestAlloc returns a free slot (or NULL), which the caller fills
+// in and passes to ApsRequestSubmit.
+ApsRequest_t *ApsRequestAlloc(void);
+void ApsRequestSubmit(ApsRequest_t *req);
+
+// Implemented in main.c. Called once a request has been submitted, to
+// get it sent from the main loop.
+void ApsRequestReady(void);
+
+// Used by the main loop. ApsRequestNextPending returns the oldest
+// request which hasn't been sent (marking it as sent), and
+// ApsRequestConfirm records its outcome for the host.
+ApsRequest_t *ApsRequestNextPending(void);
+void ApsRequestConfirm(ApsRequest_t *req, uint8_t status);
+
+// Slots are numbered 0 to APS_REQUEST_QUEUE_SIZE - 1, which lets the
+// main loop keep its own per slot state (such as a ZBOSS buffer).
+size_t ApsRequestIndex(const ApsRequest_t *req);
+ApsRequest_t *ApsRequestGet(size_t idx);
+
+// Returns the request whose confirm arrived first (or NULL if there are
+// no confirms waiting), which stays valid until ApsConfirmFree frees
+// its slot.
+const ApsRequest_t *ApsConfirmPeek(void);
+void ApsConfirmFree(void);
+
+size_t ApsConfirmCount(void);
+size_t ApsRequestFreeSlots(void);
+
+ApsRequestStats_t *ApsRequestGetStats(void);
+void ApsRequestResetStats(void);
+
+#endif  // APS_H
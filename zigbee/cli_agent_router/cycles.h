@@ -0,0 +1,47 @@
+/**
+ * cycles.h - cycle counter used for timing the protocol code
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.*
+ */
+
+#if !defined(CYCLES_H)
+#define CYCLES_H
+
+#include <stdint.h>
+
+#if defined(HOST_BUILD)
+
+#include <time.h>
+
+// There's no cycle counter to be had on the host, so nanoseconds are
+// used instead.
+static inline void CyclesInit(void) {
+}
+
+static inline uint32_t CyclesNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+#else
+
+#include "nrf.h"
+
+// Uses the DWT cycle counter, which runs at the CPU clock (64 MHz) and
+// wraps every 67 seconds, so only differences are meaningful.
+static inline void CyclesInit(void) {
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+static inline uint32_t CyclesNow(void) {
+  return DWT->CYCCNT;
+}
+
+#endif  // HOST_BUILD
+
+#endif  // CYCLES_H
@@ -0,0 +1,36 @@
+/**
+ * device_state.c - cached deCONZ device state
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.*
+ */
+
+#include "device_state.h"
+
+#include <stdbool.h>
+
+#include "nrf_log.h"
+
+#include "debug_flags.h"
+
+// Kept up to date by the ZBOSS signal handler and the APS data paths,
+// so that DEVICE_STATE can be answered without asking the stack. Those
+// (the packet handlers included) all run from the main loop.
+// All of the APS_DATA_REQUEST slots start out free.
+static uint8_t m_deviceState = DEVICE_STATE_NET_OFFLINE | DEVICE_STATE_APS_DATA_REQUEST;
+
+uint8_t DeviceStateGet(void) {
+  return m_deviceState;
+}
+
+void DeviceStateUpdate(uint8_t mask, uint8_t value) {
+  uint8_t deviceState = (m_deviceState & ~mask) | (value & mask);
+  if (deviceState != m_deviceState) {
+    if (DEBUG_raw) {
+      NRF_LOG_INFO("Device state 0x%02x -> 0x%02x", m_deviceState, deviceState);
+    }
+    m_deviceState = deviceState;
+    DeviceStateChanged(deviceState);
+  }
+}
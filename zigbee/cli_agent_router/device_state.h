@@ -0,0 +1,44 @@
+/**
+ * device_state.h - cached deCONZ device state
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.*
+ */
+
+#if !defined(DEVICE_STATE_H)
+#define DEVICE_STATE_H
+
+#include <stdint.h>
+
+// The device state byte returned by DEVICE_STATE and pushed with
+// DEVICE_STATE_CHANGED. The low 2 bits hold the network state.
+#define DEVICE_STATE_NET_OFFLINE          0x00
+#define DEVICE_STATE_NET_JOINING          0x01
+#define DEVICE_STATE_NET_CONNECTED        0x02
+#define DEVICE_STATE_NET_LEAVING          0x03
+#define DEVICE_STATE_NET_MASK             0x03
+
+#define DEVICE_STATE_APS_DATA_CONFIRM     0x04  // APS_DATA_CONFIRM waiting to be read
+#define DEVICE_STATE_APS_DATA_INDICATION  0x08  // APS_DATA_INDICATION waiting to be read
+#define DEVICE_STATE_CONF_CHANGED         0x10
+#define DEVICE_STATE_APS_DATA_REQUEST     0x20  // room for another APS_DATA_REQUEST
+
+uint8_t DeviceStateGet(void);
+
+// Replaces the bits selected by mask with those from value. If that
+// changes anything, DeviceStateChanged gets called.
+void DeviceStateUpdate(uint8_t mask, uint8_t value);
+
+static inline void DeviceStateSetNetwork(uint8_t netState) {
+  DeviceStateUpdate(DEVICE_STATE_NET_MASK, netState);
+}
+
+static inline void DeviceStateSetFlag(uint8_t flag, int set) {
+  DeviceStateUpdate(flag, set ? flag : 0);
+}
+
+// Implemented in main.c. Passes the new state on to the hosts.
+void DeviceStateChanged(uint8_t deviceState);
+
+#endif  // DEVICE_STATE_H
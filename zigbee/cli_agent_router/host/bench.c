@@ -0,0 +1,2030 @@
+/**
+ * bench.c - host benchmark for the SLIP/deCONZ protocol path
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.*
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aps.h"
+#include "device_state.h"
+#include "host_stubs.h"
+#include "nrf_log.h"
+#include "packet.h"
+#include "packet_port.h"
+#include "param.h"
+#include "slip.h"
+
+// Chunk size used when feeding the parser. This matches the size of the
+// RX buffers main.c reads into.
+#define CHUNK_SIZE        PACKET_RX_BUFFER_SIZE
+
+#define MAX_FRAMES        128
+#define MAX_FRAME_LEN     (MAX_PACKET_LEN + 2)
+#define MAX_STREAM_LEN    (MAX_FRAMES * (MAX_FRAME_LEN * 2 + 2))
+
+#define ARRAY_LEN(array)  (sizeof(array) / sizeof((array)[0]))
+
+typedef struct {
+  size_t    len;
+  uint8_t   buf[MAX_FRAME_LEN];
+} Frame_t;
+
+typedef struct {
+  const char *name;
+  size_t      numFrames;
+  Frame_t     frame[MAX_FRAMES];
+  size_t      streamLen;
+  uint8_t     stream[MAX_STREAM_LEN];
+} Mix_t;
+
+static Mix_t m_requests = { .name = "requests" };
+static Mix_t m_responses = { .name = "responses" };
+
+// Full size frames with a given percentage of payload bytes needing an
+// escape, for comparing the SLIP byte classifiers (SLIP_CONFIG_USE_LUT).
+static const int m_escapePercent[] = { 0, 1, 10 };
+static Mix_t m_density[3] = {
+  { .name = "esc0%" },
+  { .name = "esc1%" },
+  { .name = "esc10%" },
+};
+
+static uint8_t m_seqNum;
+static uint32_t m_rand = 0x12345678;
+
+static int m_rounds = 2000;
+
+// Where frames decoded by the parser callbacks end up.
+static const Mix_t *m_expectMix;
+static size_t m_rcvdFrames;
+static size_t m_rcvdBytes;
+static bool m_rcvdMismatch;
+
+static uint32_t Random(void) {
+  // xorshift32 - good enough to generate payload bytes and repeatable
+  m_rand ^= m_rand << 13;
+  m_rand ^= m_rand >> 17;
+  m_rand ^= m_rand << 5;
+  return m_rand;
+}
+
+static uint64_t NowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Builds a complete deCONZ frame (header, payload and CRC).
+static Frame_t *AddFrame(Mix_t *mix, uint8_t commandId,
+                         const uint8_t *payload, size_t payloadLen) {
+  if (mix->numFrames >= MAX_FRAMES || payloadLen + 7 > MAX_FRAME_LEN) {
+    fprintf(stderr, "Too many frames in %s mix\n", mix->name);
+    exit(1);
+  }
+  Frame_t *frame = &mix->frame[mix->numFrames++];
+  uint16_t frameLen = 5 + payloadLen;
+  frame->buf[0] = commandId;
+  frame->buf[1] = m_seqNum++;
+  frame->buf[2] = 0;
+  frame->buf[3] = frameLen & 0xff;
+  frame->buf[4] = frameLen >> 8;
+  memcpy(&frame->buf[5], payload, payloadLen);
+
+  uint16_t crc = 0;
+  for (size_t i = 0; i < frameLen; i++) {
+    crc += frame->buf[i];
+  }
+  crc = ~crc + 1;
+  frame->buf[frameLen] = crc & 0xff;
+  frame->buf[frameLen + 1] = crc >> 8;
+  frame->len = frameLen + 2;
+  return frame;
+}
+
+static void AddReadParameter(Mix_t *mix, uint8_t parameterId) {
+  uint8_t payload[] = { 1, 0, parameterId };
+  AddFrame(mix, READ_PARAMETER, payload, sizeof(payload));
+}
+
+static void AddWriteParameter(Mix_t *mix, uint8_t parameterId, const uint8_t *value, size_t len) {
+  uint8_t payload[3 + PARAM_MAX_LEN];
+  payload[0] = 1 + len;
+  payload[1] = 0;
+  payload[2] = parameterId;
+  memcpy(&payload[3], value, len);
+  AddFrame(mix, WRITE_PARAMETER, payload, 3 + len);
+}
+
+// An empty list asks for every parameter.
+static void AddReadParameters(Mix_t *mix, const uint8_t *ids, size_t numIds) {
+  uint8_t payload[2 + MAX_PACKET_LEN];
+  payload[0] = numIds & 0xff;
+  payload[1] = numIds >> 8;
+  memcpy(&payload[2], ids, numIds);
+  AddFrame(mix, READ_PARAMETERS, payload, 2 + numIds);
+}
+
+static void AddDeviceState(Mix_t *mix) {
+  uint8_t payload[] = { 0, 0, 0 };
+  AddFrame(mix, DEVICE_STATE, payload, sizeof(payload));
+}
+
+static void AddApsDataIndicationRequest(Mix_t *mix) {
+  uint8_t payload[] = { 1, 0, 0x04 };
+  AddFrame(mix, APS_DATA_INDICATION, payload, sizeof(payload));
+}
+
+#define PROFILE_ZDO         0x0000
+#define PROFILE_HA          0x0104
+#define CLUSTER_ON_OFF      0x0006
+#define CLUSTER_MGMT_LQI_REQ 0x0031
+#define CLUSTER_MGMT_LQI_RSP 0x8031
+
+// An APS_DATA_REQUEST as the tester's ZDO code sends them: a
+// Mgmt_Lqi_req to a 16-bit address.
+static void AddApsDataRequest(Mix_t *mix, uint8_t requestId, uint8_t dstAddrMode) {
+  uint8_t payload[MAX_FRAME_LEN];
+  uint8_t *p = &payload[2];
+
+  *p++ = requestId;
+  *p++ = 0;                         // flags
+  *p++ = dstAddrMode;
+  if (dstAddrMode == APS_ADDR_MODE_IEEE) {
+    for (int i = 0; i < 8; i++) {
+      *p++ = requestId + i;
+    }
+  } else {
+    *p++ = requestId; *p++ = 0x12;
+  }
+  if (dstAddrMode != APS_ADDR_MODE_GROUP) {
+    *p++ = 0x00;                    // dst endpoint
+  }
+  *p++ = PROFILE_ZDO & 0xff; *p++ = PROFILE_ZDO >> 8;
+  *p++ = CLUSTER_MGMT_LQI_REQ & 0xff; *p++ = CLUSTER_MGMT_LQI_REQ >> 8;
+  *p++ = 0x00;                      // src endpoint
+  *p++ = 2; *p++ = 0;               // asduLen
+  *p++ = requestId;                 // ZDO seqNum
+  *p++ = 0;                         // start index
+  *p++ = 0x04;                      // tx options (APS ack)
+  *p++ = 0;                         // radius
+  size_t payloadLen = p - payload;
+  payload[0] = (payloadLen - 2) & 0xff;
+  payload[1] = (payloadLen - 2) >> 8;
+  AddFrame(mix, APS_DATA_REQUEST, payload, payloadLen);
+}
+
+static void AddApsDataConfirmRequest(Mix_t *mix) {
+  uint8_t payload[] = { 0, 0 };
+  AddFrame(mix, APS_DATA_CONFIRM, payload, sizeof(payload));
+}
+
+// An APS_DATA_INDICATION response carrying a ZCL attribute report (or
+// ZDO response) from a 16-bit source address.
+static void AddApsDataIndicationResponse(Mix_t *mix, uint16_t profileId,
+                                         uint16_t clusterId, size_t asduLen) {
+  uint8_t endpoint = profileId == PROFILE_ZDO ? 0x00 : 0x01;
+  uint8_t payload[MAX_FRAME_LEN];
+  uint8_t *p = &payload[2];
+
+  *p++ = 0x22;                      // device state
+  *p++ = 0x02;                      // dst addr mode (16-bit)
+  *p++ = 0x00; *p++ = 0x00;         // dst addr
+  *p++ = endpoint;                  // dst endpoint
+  *p++ = 0x02;                      // src addr mode (16-bit)
+  uint16_t srcAddr = Random();
+  *p++ = srcAddr & 0xff; *p++ = srcAddr >> 8;
+  *p++ = endpoint;                  // src endpoint
+  *p++ = profileId & 0xff; *p++ = profileId >> 8;
+  *p++ = clusterId & 0xff; *p++ = clusterId >> 8;
+  *p++ = asduLen & 0xff; *p++ = asduLen >> 8;
+  for (size_t i = 0; i < asduLen; i++) {
+    *p++ = Random();
+  }
+  *p++ = 0; *p++ = 0;               // reserved
+  *p++ = 0xff;                      // lqi
+  *p++ = 0; *p++ = 0; *p++ = 0; *p++ = 0;
+  *p++ = 0xc4;                      // rssi
+  size_t payloadLen = p - payload;
+  payload[0] = (payloadLen - 2) & 0xff;
+  payload[1] = (payloadLen - 2) >> 8;
+  AddFrame(mix, APS_DATA_INDICATION, payload, payloadLen);
+}
+
+// Queues the indication carried by a response built by
+// AddApsDataIndicationResponse, as the ZBOSS endpoint handler would.
+static bool QueueIndication(const Frame_t *response) {
+  const uint8_t *p = &response->buf[8];
+  ApsIndication_t *ind = ApsIndicationAlloc();
+  if (ind == NULL) {
+    return false;
+  }
+  ind->dstAddrMode = *p++;
+  ind->dstAddr16 = p[0] | (p[1] << 8);
+  p += 2;
+  ind->dstEndpoint = *p++;
+  ind->srcAddrMode = *p++;
+  ind->srcAddr16 = p[0] | (p[1] << 8);
+  p += 2;
+  ind->srcEndpoint = *p++;
+  ind->profileId = p[0] | (p[1] << 8);
+  ind->clusterId = p[2] | (p[3] << 8);
+  ind->asduLen = p[4] | (p[5] << 8);
+  p += 6;
+  memcpy(ind->asdu, p, ind->asduLen);
+  p += ind->asduLen;
+  ind->lqi = p[2];
+  ind->rssi = p[7];
+  ApsIndicationCommit();
+  return true;
+}
+
+static void AddEscapeDensityFrame(Mix_t *mix, int escapePercent) {
+  uint8_t payload[MAX_PACKET_LEN - 7];
+  for (size_t i = 0; i < sizeof(payload); i++) {
+    if ((int)(Random() % 100) < escapePercent) {
+      payload[i] = (Random() & 1) ? 0xc0 : 0xdb;  // END or ESC
+    } else {
+      do {
+        payload[i] = Random();
+      } while (payload[i] == 0xc0 || payload[i] == 0xdb);
+    }
+  }
+  AddFrame(mix, APS_DATA_INDICATION, payload, sizeof(payload));
+}
+
+static void EncodeStream(Mix_t *mix) {
+  mix->streamLen = 0;
+  for (size_t i = 0; i < mix->numFrames; i++) {
+    Packet_t pkt = { .len = mix->frame[i].len, .buf = mix->frame[i].buf };
+    mix->streamLen += SLIP_encapsulate(&pkt, &mix->stream[mix->streamLen],
+                                       sizeof(mix->stream) - mix->streamLen);
+  }
+}
+
+static void CaptureFrame(const Packet_t *packet, void *context) {
+  if (packet->buf[2] != STATUS_SUCCESS) {
+    // Error responses to the requests which aren't handled yet.
+    return;
+  }
+  Frame_t *frame = AddFrame(&m_responses, packet->buf[0], &packet->buf[5],
+                            packet->len - 7);
+  memcpy(frame->buf, packet->buf, packet->len);
+}
+
+static SLIP_Parser_t m_captureParser;
+
+// Status which RunStack confirms requests with.
+static uint8_t m_confirmStatus = APS_STATUS_SUCCESS;
+
+// Stands in for the main loop handing requests to ZBOSS, and ZBOSS
+// confirming them straight away.
+static void RunStack(void) {
+  ApsRequest_t *req;
+  while ((req = ApsRequestNextPending()) != NULL) {
+    ApsRequestConfirm(req, m_confirmStatus);
+  }
+}
+
+// The firmware side of the link.
+static PacketPort_t m_port;
+
+static void CaptureResponse(uint8_t *buf, size_t bufLen) {
+  // Responses come out SLIP encoded - strip the framing back off.
+  SLIP_parseChunk(&m_captureParser, buf, bufLen);
+}
+
+static void BuildMixes(void) {
+  // The tester's startup: readParameters() for each entry in PARAM,
+  // followed by DEVICE_STATE polling, ZDO requests and draining of
+  // indications and confirms.
+  AddReadParameter(&m_requests, PARAM_ID_MAC_ADRESS);
+  AddReadParameter(&m_requests, PARAM_ID_PAN_ID64);
+  AddReadParameter(&m_requests, PARAM_ID_SCAN_CHANNELS);
+  AddReadParameter(&m_requests, PARAM_ID_OPERATING_CHANNEL);
+  for (int i = 0; i < 4; i++) {
+    AddDeviceState(&m_requests);
+    AddApsDataRequest(&m_requests, i, APS_ADDR_MODE_NWK);
+    AddDeviceState(&m_requests);
+    AddApsDataConfirmRequest(&m_requests);
+    AddApsDataIndicationRequest(&m_requests);
+  }
+  EncodeStream(&m_requests);
+
+  // Use the firmware to generate the responses it knows how to make,
+  // and fill in the remainder synthetically.
+  SLIP_initParser(&m_captureParser, CaptureFrame, NULL);
+  HostWriteResponse = CaptureResponse;
+  for (size_t i = 0; i < m_requests.numFrames; i++) {
+    Packet_t pkt = { .len = m_requests.frame[i].len,
+                     .buf = m_requests.frame[i].buf };
+    PacketReceived(&m_port, &pkt);
+  }
+  HostWriteResponse = NULL;
+  for (int i = 0; i < 4; i++) {
+    if (i & 1) {
+      // Mgmt_Lqi_rsp with a couple of neighbor table entries
+      AddApsDataIndicationResponse(&m_responses, PROFILE_ZDO,
+                                   CLUSTER_MGMT_LQI_RSP, 5 + 2 * 22);
+    } else {
+      AddApsDataIndicationResponse(&m_responses, PROFILE_HA,
+                                   CLUSTER_ON_OFF, 8 + (Random() % 72));
+    }
+  }
+  EncodeStream(&m_responses);
+
+  for (size_t i = 0; i < ARRAY_LEN(m_density); i++) {
+    for (int j = 0; j < 32; j++) {
+      AddEscapeDensityFrame(&m_density[i], m_escapePercent[i]);
+    }
+    EncodeStream(&m_density[i]);
+  }
+}
+
+static void CheckFrame(const Packet_t *packet, void *context) {
+  if (m_expectMix) {
+    const Frame_t *expect = &m_expectMix->frame[m_rcvdFrames % m_expectMix->numFrames];
+    if (packet->len != expect->len || memcmp(packet->buf, expect->buf, expect->len) != 0) {
+      m_rcvdMismatch = true;
+    } else if (packet->crcKnown) {
+      uint16_t frameCrc = packet->buf[packet->len - 2] + (packet->buf[packet->len - 1] << 8);
+      if (packet->crc != frameCrc) {
+        m_rcvdMismatch = true;
+      }
+    }
+  }
+  m_rcvdFrames++;
+  m_rcvdBytes += packet->len;
+}
+
+static void CountFrame(const Packet_t *packet, void *context) {
+  m_rcvdFrames++;
+  m_rcvdBytes += packet->len;
+}
+
+// Feeds the stream to the parser the way main.c does: each chunk is
+// first placed in an rx buffer (by the USB DMA on the target).
+static void FeedStreamChunks(SLIP_Parser_t *parser, const Mix_t *mix,
+                             bool inPlace, size_t chunkSize) {
+  static uint8_t rxBuf[MAX_STREAM_LEN];
+  for (size_t offset = 0; offset < mix->streamLen; offset += chunkSize) {
+    size_t chunkLen = mix->streamLen - offset;
+    if (chunkLen > chunkSize) {
+      chunkLen = chunkSize;
+    }
+    memcpy(rxBuf, &mix->stream[offset], chunkLen);
+    if (inPlace) {
+      SLIP_parseChunkInPlace(parser, rxBuf, chunkLen);
+    } else {
+      SLIP_parseChunk(parser, rxBuf, chunkLen);
+    }
+  }
+}
+
+static void FeedStream(SLIP_Parser_t *parser, const Mix_t *mix, bool inPlace) {
+  FeedStreamChunks(parser, mix, inPlace, CHUNK_SIZE);
+}
+
+static void Report(const char *name, uint64_t ns, size_t frames, size_t bytes) {
+  double secs = ns / 1e9;
+  printf("%-32s %8zu frames %9.2f MB/s %12.0f frames/s %9.1f ns/frame\n",
+         name, frames, bytes / secs / 1e6, frames / secs,
+         (double)ns / frames);
+}
+
+// Makes sure that the decoder reproduces the frames exactly before we
+// bother timing anything.
+static void VerifyDecode(const Mix_t *mix) {
+  // Odd chunk sizes make sure that frames and escape sequences get
+  // split across chunks.
+  static const size_t chunkSize[] = { 1, 2, 7, 13, CHUNK_SIZE };
+  for (int inPlace = 0; inPlace <= 1; inPlace++) {
+    for (size_t i = 0; i < sizeof(chunkSize) / sizeof(chunkSize[0]); i++) {
+      SLIP_Parser_t parser;
+      SLIP_initParser(&parser, CheckFrame, NULL);
+      m_expectMix = mix;
+      m_rcvdFrames = 0;
+      m_rcvdMismatch = false;
+      FeedStreamChunks(&parser, mix, inPlace, chunkSize[i]);
+      m_expectMix = NULL;
+      if (m_rcvdMismatch || m_rcvdFrames != mix->numFrames) {
+        fprintf(stderr, "%s: decoded %zu of %zu frames%s (%s, %zu byte chunks)\n",
+                mix->name, m_rcvdFrames, mix->numFrames,
+                m_rcvdMismatch ? " with mismatches" : "",
+                inPlace ? "in place" : "copy", chunkSize[i]);
+        exit(1);
+      }
+    }
+  }
+}
+
+// Makes sure that encoding a piece at a time produces the same output
+// as encoding in one go, wherever the escape sequences get split.
+static void VerifyEncode(const Mix_t *mix) {
+  static const size_t chunkSize[] = { 1, 2, 3, 7, CHUNK_SIZE };
+  uint8_t expect[MAX_FRAME_LEN * 2 + 2];
+  uint8_t actual[MAX_FRAME_LEN * 2 + 2];
+
+  for (size_t i = 0; i < mix->numFrames; i++) {
+    Packet_t pkt = { .len = mix->frame[i].len, .buf = (uint8_t *)mix->frame[i].buf };
+    size_t expectLen = SLIP_encapsulate(&pkt, expect, sizeof(expect));
+    for (size_t j = 0; j < sizeof(chunkSize) / sizeof(chunkSize[0]); j++) {
+      SLIP_Encoder_t encoder;
+      size_t actualLen = 0;
+      size_t chunkLen;
+      SLIP_initEncoder(&encoder, &pkt);
+      while ((chunkLen = SLIP_encodeChunk(&encoder, &actual[actualLen], chunkSize[j])) > 0) {
+        actualLen += chunkLen;
+      }
+      if (!SLIP_encoderDone(&encoder) || actualLen != expectLen ||
+          memcmp(actual, expect, expectLen) != 0) {
+        fprintf(stderr, "%s: frame %zu encoded differently with %zu byte chunks\n",
+                mix->name, i, chunkSize[j]);
+        exit(1);
+      }
+    }
+  }
+}
+
+// Splits a frame into header/payload segments (leaving off the CRC) as
+// a response handler would present it to SLIP_encapsulatev.
+static size_t FrameSegments(const Frame_t *frame, SLIP_Segment_t *seg) {
+  seg[0].buf = frame->buf;
+  seg[0].len = 5;
+  seg[1].buf = &frame->buf[5];
+  seg[1].len = frame->len - 7;
+  return 2;
+}
+
+// Makes sure that the scatter/gather encoder produces the same thing as
+// the plain encoder, CRC included.
+static void VerifyEncodev(const Mix_t *mix) {
+  uint8_t expect[MAX_FRAME_LEN * 2 + 2];
+  uint8_t actual[MAX_FRAME_LEN * 2 + 2];
+
+  for (size_t i = 0; i < mix->numFrames; i++) {
+    Packet_t pkt = { .len = mix->frame[i].len, .buf = (uint8_t *)mix->frame[i].buf };
+    SLIP_Segment_t seg[2];
+    size_t numSegs = FrameSegments(&mix->frame[i], seg);
+    size_t expectLen = SLIP_encapsulate(&pkt, expect, sizeof(expect));
+    size_t actualLen = SLIP_encapsulatev(seg, numSegs, actual, sizeof(actual));
+    if (actualLen != expectLen || memcmp(actual, expect, expectLen) != 0) {
+      fprintf(stderr, "%s: frame %zu encoded differently by SLIP_encapsulatev\n",
+              mix->name, i);
+      exit(1);
+    }
+  }
+}
+
+// The mixes only hold frames of up to MAX_PACKET_LEN bytes, so the CRC
+// of long runs without escapes (such as FRAGMENTed responses) is checked
+// separately. The word at a time classifier sums those in lanes, which
+// have to be folded without carrying into each other.
+static void VerifyLongRun(void) {
+  static const size_t runLen[] = { 400, PACKET_FRAGMENTED_MAX_LEN };
+  static uint8_t run[PACKET_FRAGMENTED_MAX_LEN];
+  static uint8_t actual[PACKET_FRAGMENTED_MAX_LEN * 2 + 6];
+  memset(run, 0xfe, sizeof(run));
+
+  for (size_t i = 0; i < ARRAY_LEN(runLen); i++) {
+    uint16_t sum = 0;
+    for (size_t j = 0; j < runLen[i]; j++) {
+      sum += run[j];
+    }
+    uint16_t expectCrc = ~sum + 1;
+    SLIP_Segment_t seg = { .buf = run, .len = runLen[i] };
+    size_t actualLen = SLIP_encapsulatev(&seg, 1, actual, sizeof(actual));
+    // END, the run, the CRC and END (0xfe never needs escaping).
+    uint16_t actualCrc = actual[runLen[i] + 1] + (actual[runLen[i] + 2] << 8);
+    if (actualLen != runLen[i] + 4 || actualCrc != expectCrc) {
+      fprintf(stderr, "long_run: %zu bytes of 0xfe got CRC 0x%04x rather than 0x%04x\n",
+              runLen[i], actualCrc, expectCrc);
+      exit(1);
+    }
+  }
+}
+
+static void StalledTxReady(PacketPort_t *port) {
+  // An endpoint which never becomes free.
+}
+
+// Makes sure that a port whose host has stopped reading doesn't stop
+// another port from answering requests.
+static void VerifyPorts(const Mix_t *mix) {
+  PacketPort_t stalled;
+  PacketPort_t port;
+  PacketPortInit(&stalled, StalledTxReady, NULL);
+  PacketPortInit(&port, HostTxReady, NULL);
+
+  // The first request is a READ_PARAMETER, which always gets a response.
+  uint8_t buf[MAX_FRAME_LEN];
+  Packet_t pkt = { .len = mix->frame[0].len, .buf = buf };
+  memcpy(buf, mix->frame[0].buf, pkt.len);
+  PacketReceived(&stalled, &pkt);
+
+  unsigned long responses = HostResponseCount;
+  unsigned long bytes = HostResponseBytes;
+  PacketReceived(&port, &pkt);
+  if (stalled.txUsed == 0 || HostResponseCount != responses + 1 ||
+      HostResponseBytes == bytes) {
+    fprintf(stderr, "%s: response blocked by another port\n", mix->name);
+    exit(1);
+  }
+}
+
+static const Frame_t *FirstFrame(const Mix_t *mix, uint8_t commandId) {
+  for (size_t i = 0; i < mix->numFrames; i++) {
+    if (mix->frame[i].buf[0] == commandId) {
+      return &mix->frame[i];
+    }
+  }
+  fprintf(stderr, "%s: no 0x%02x frames\n", mix->name, commandId);
+  exit(1);
+}
+
+static void SaveFrame(const Packet_t *packet, void *context) {
+  Frame_t *frame = context;
+  frame->len = packet->len;
+  memcpy(frame->buf, packet->buf, packet->len);
+}
+
+// Sends frame to the firmware and returns the response (or a zero
+// length frame if there wasn't one).
+static Frame_t Exchange(const Frame_t *request) {
+  Frame_t response = { .len = 0 };
+  uint8_t buf[MAX_FRAME_LEN];
+  Packet_t pkt = { .len = request->len, .buf = buf };
+
+  memcpy(buf, request->buf, request->len);
+  SLIP_initParser(&m_captureParser, SaveFrame, &response);
+  HostWriteResponse = CaptureResponse;
+  PacketReceived(&m_port, &pkt);
+  HostWriteResponse = NULL;
+  return response;
+}
+
+// Makes sure that requests the firmware can't handle get an error
+// response carrying the request's seqNum, rather than nothing at all.
+static void VerifyErrors(void) {
+  static Mix_t errors = { .name = "errors" };
+  uint8_t unknownCommand[] = { 0, 0, 0 };
+  AddFrame(&errors, 0x7f, unknownCommand, sizeof(unknownCommand));
+  AddReadParameter(&errors, 0xee);
+  uint8_t tooShort[] = { 1 };
+  AddFrame(&errors, READ_PARAMETER, tooShort, sizeof(tooShort));
+  static const uint8_t expectStatus[] = {
+    STATUS_UNSUPPORTED, STATUS_UNSUPPORTED, STATUS_INVALID_VALUE
+  };
+
+  for (size_t i = 0; i < errors.numFrames; i++) {
+    const Frame_t *request = &errors.frame[i];
+    Frame_t response = Exchange(request);
+    if (response.len < 7 || response.buf[0] != request->buf[0] ||
+        response.buf[1] != request->buf[1] || response.buf[2] != expectStatus[i]) {
+      fprintf(stderr, "errors: no status %u response to request %zu\n",
+              expectStatus[i], i);
+      exit(1);
+    }
+  }
+}
+
+// Makes sure that every parameter in the packet.h table can be read,
+// and that reads reflect what's in the cache.
+static void VerifyParameters(void) {
+  static Mix_t requests = { .name = "parameters" };
+  static const struct {
+    uint8_t id;
+    uint8_t len;
+  } param[] = {
+    { PARAM_ID_MAC_ADRESS, 8 },           { PARAM_ID_PAN_ID16, 2 },
+    { PARAM_ID_NWK_ADDR16, 2 },           { PARAM_ID_PAN_ID64, 8 },
+    { PARAM_ID_APS_DESIGNATED_COORDINATOR, 1 }, { PARAM_ID_SCAN_CHANNELS, 4 },
+    { PARAM_ID_APS_PAN_ID64, 8 },         { PARAM_ID_TRUST_CENTER_ADDR64, 8 },
+    { PARAM_ID_SECURITY_MODE, 1 },        { PARAM_ID_NETWORK_KEY, 16 },
+    { PARAM_ID_OPERATING_CHANNEL, 1 },    { PARAM_ID_PERMIT_JOIN, 1 },
+    { PARAM_ID_PROTOCOL_VERSION, 2 },     { PARAM_ID_NETWORK_UPDATE_ID, 1 },
+  };
+
+  for (size_t i = 0; i < ARRAY_LEN(param); i++) {
+    AddReadParameter(&requests, param[i].id);
+    for (int pass = 0; pass < 2; pass++) {
+      size_t len = 0;
+      const uint8_t *value = ParamGet(param[i].id, &len);
+      Frame_t response = Exchange(&requests.frame[i]);
+      if (value == NULL || len != param[i].len || response.buf[2] != STATUS_SUCCESS ||
+          response.len != 5 + 2 + 1 + len + 2 || response.buf[5] != 1 + len ||
+          response.buf[7] != param[i].id || memcmp(&response.buf[8], value, len) != 0) {
+        fprintf(stderr, "parameters: 0x%02x read back wrong\n", param[i].id);
+        exit(1);
+      }
+      // Change it and make sure the read follows.
+      uint8_t newValue[PARAM_MAX_LEN];
+      memcpy(newValue, value, len);
+      newValue[0] ^= 0x5a;
+      if (!ParamSet(param[i].id, newValue, len) || ParamSet(param[i].id, newValue, len)) {
+        fprintf(stderr, "parameters: 0x%02x change not noticed\n", param[i].id);
+        exit(1);
+      }
+    }
+  }
+  ParamRefresh();
+  ParamSetU8(PARAM_ID_PERMIT_JOIN, 0);
+  ParamSet(PARAM_ID_APS_PAN_ID64, (uint8_t[8]) { 0 }, 8);
+}
+
+static unsigned m_paramWrittenCalls;
+
+static void CountParamWritten(void) {
+  m_paramWrittenCalls++;
+}
+
+// Makes sure that WRITE_PARAMETER changes the cache and hands each
+// written parameter to the main loop once, however many times it was
+// written, and that read only parameters and bad lengths are refused.
+static void VerifyWriteParameter(void) {
+  static Mix_t requests = { .name = "write_parameter" };
+  static const uint8_t writable[] = {
+    PARAM_ID_PAN_ID64, PARAM_ID_SCAN_CHANNELS, PARAM_ID_NETWORK_KEY,
+    PARAM_ID_PERMIT_JOIN
+  };
+  uint8_t saved[ARRAY_LEN(writable)][PARAM_MAX_LEN];
+  size_t savedLen[ARRAY_LEN(writable)];
+
+  HostParamWritten = CountParamWritten;
+  m_paramWrittenCalls = 0;
+  ParamResetStats();
+
+  // Write each of them twice, as a host resending its configuration would.
+  for (int pass = 0; pass < 2; pass++) {
+    for (size_t i = 0; i < ARRAY_LEN(writable); i++) {
+      const uint8_t *value = ParamGet(writable[i], &savedLen[i]);
+      uint8_t newValue[PARAM_MAX_LEN];
+      if (pass == 0) {
+        memcpy(saved[i], value, savedLen[i]);
+      }
+      memcpy(newValue, value, savedLen[i]);
+      newValue[0] ^= 0x5a;
+
+      requests.numFrames = 0;
+      AddWriteParameter(&requests, writable[i], newValue, savedLen[i]);
+      Frame_t response = Exchange(&requests.frame[0]);
+      value = ParamGet(writable[i], &savedLen[i]);
+      if (response.len != 5 + 2 + 1 + 2 || response.buf[0] != WRITE_PARAMETER ||
+          response.buf[2] != STATUS_SUCCESS || response.buf[5] != 1 ||
+          response.buf[7] != writable[i] || memcmp(value, newValue, savedLen[i]) != 0) {
+        fprintf(stderr, "write_parameter: 0x%02x not written\n", writable[i]);
+        exit(1);
+      }
+    }
+  }
+  uint8_t paramId;
+  size_t taken = 0;
+  while (ParamTakeWritten(&paramId)) {
+    taken++;
+  }
+  if (taken != ARRAY_LEN(writable) || m_paramWrittenCalls != 2 * ARRAY_LEN(writable) ||
+      ParamGetStats()->writes != 2 * ARRAY_LEN(writable)) {
+    fprintf(stderr, "write_parameter: %zu parameters to apply after %u writes\n",
+            taken, m_paramWrittenCalls);
+    exit(1);
+  }
+
+  // Read only, unknown, the wrong length for the parameter, and a
+  // payloadLen which doesn't match the frame.
+  uint8_t value[PARAM_MAX_LEN] = { 0 };
+  requests.numFrames = 0;
+  AddWriteParameter(&requests, PARAM_ID_MAC_ADRESS, value, 8);
+  AddWriteParameter(&requests, PARAM_ID_NETWORK_UPDATE_ID, value, 1);
+  AddWriteParameter(&requests, 0xee, value, 1);
+  AddWriteParameter(&requests, PARAM_ID_PAN_ID64, value, 2);
+  uint8_t badLen[] = { 3, 0, PARAM_ID_PERMIT_JOIN, 0 };
+  AddFrame(&requests, WRITE_PARAMETER, badLen, sizeof(badLen));
+  static const uint8_t expectStatus[] = {
+    STATUS_UNSUPPORTED, STATUS_UNSUPPORTED, STATUS_UNSUPPORTED, STATUS_INVALID_VALUE,
+    STATUS_INVALID_VALUE
+  };
+  for (size_t i = 0; i < ARRAY_LEN(expectStatus); i++) {
+    Frame_t response = Exchange(&requests.frame[i]);
+    if (response.len < 7 || response.buf[2] != expectStatus[i]) {
+      fprintf(stderr, "write_parameter: bad write %zu not rejected\n", i);
+      exit(1);
+    }
+  }
+  if (ParamTakeWritten(&paramId) || m_paramWrittenCalls != 2 * ARRAY_LEN(writable) ||
+      ParamGetStats()->rejected != 4) {
+    fprintf(stderr, "write_parameter: rejected writes were applied\n");
+    exit(1);
+  }
+
+  for (size_t i = 0; i < ARRAY_LEN(writable); i++) {
+    ParamSet(writable[i], saved[i], savedLen[i]);
+  }
+  HostParamWritten = NULL;
+}
+
+static void DrainPort(PacketPort_t *port) {
+  uint8_t txBuf[CHUNK_SIZE];
+  size_t txLen;
+  while ((txLen = PacketTxFill(port, txBuf, sizeof(txBuf))) > 0) {
+    SLIP_parseChunk(&m_captureParser, txBuf, txLen);
+  }
+}
+
+// Makes sure that a resent APS_DATA_REQUEST or WRITE_PARAMETER is
+// answered with the original response without being carried out again,
+// and that the cache forgets a request once the seqNums have moved on.
+static void VerifyResponseCache(void) {
+  static Mix_t requests = { .name = "response_cache" };
+  static Mix_t later = { .name = "response_cache" };
+  static const uint8_t permitJoin = 60;
+
+  HostApsRequestReady = NULL;
+  HostParamWritten = CountParamWritten;
+  m_paramWrittenCalls = 0;
+  ApsRequestResetStats();
+  m_port.txStats.replayed = 0;
+
+  AddApsDataRequest(&requests, 0x60, APS_ADDR_MODE_NWK);
+  AddWriteParameter(&requests, PARAM_ID_PERMIT_JOIN, &permitJoin, 1);
+  for (size_t i = 0; i < requests.numFrames; i++) {
+    Frame_t first = Exchange(&requests.frame[i]);
+    Frame_t retry = Exchange(&requests.frame[i]);
+    if (first.buf[2] != STATUS_SUCCESS || retry.len != first.len ||
+        memcmp(retry.buf, first.buf, first.len) != 0) {
+      fprintf(stderr, "response_cache: retry of request %zu answered differently\n", i);
+      exit(1);
+    }
+  }
+  if (ApsRequestGetStats()->submitted != 1 || m_paramWrittenCalls != 1 ||
+      m_port.txStats.replayed != 2) {
+    fprintf(stderr, "response_cache: retries were carried out again\n");
+    exit(1);
+  }
+
+  // Once requests further on than the window have been seen, the same
+  // seqNum is a new request.
+  for (int i = 0; i <= PACKET_RESPONSE_CACHE_WINDOW; i++) {
+    later.numFrames = 0;
+    AddDeviceState(&later);
+    Exchange(&later.frame[0]);
+  }
+  Exchange(&requests.frame[0]);
+  if (ApsRequestGetStats()->submitted != 2 || m_port.txStats.replayed != 2) {
+    fprintf(stderr, "response_cache: stale response replayed\n");
+    exit(1);
+  }
+
+  // A response lost to a full TX queue isn't cached, so it doesn't push
+  // out the oldest entry (which is next in line to be reused). The
+  // host's retry of that request is carried out again.
+  static PacketPort_t stalled;
+  PacketPortInit(&stalled, StalledTxReady, NULL);
+  later.numFrames = 0;
+  for (size_t i = 0; i <= PACKET_RESPONSE_CACHE_SIZE; i++) {
+    AddWriteParameter(&later, PARAM_ID_PERMIT_JOIN, &permitJoin, 1);
+  }
+  AddDeviceState(&later);
+  for (size_t i = 0; i < PACKET_RESPONSE_CACHE_SIZE; i++) {
+    Packet_t write = { .len = later.frame[i].len, .buf = later.frame[i].buf };
+    PacketReceived(&stalled, &write);
+  }
+  Packet_t fill = { .len = later.frame[PACKET_RESPONSE_CACHE_SIZE + 1].len,
+                    .buf = later.frame[PACKET_RESPONSE_CACHE_SIZE + 1].buf };
+  while (stalled.txStats.overflow == 0) {
+    PacketReceived(&stalled, &fill);
+  }
+  unsigned writtenCalls = m_paramWrittenCalls;
+  Packet_t dropped = { .len = later.frame[PACKET_RESPONSE_CACHE_SIZE].len,
+                       .buf = later.frame[PACKET_RESPONSE_CACHE_SIZE].buf };
+  PacketReceived(&stalled, &dropped);
+  SLIP_initParser(&m_captureParser, CountFrame, NULL);
+  DrainPort(&stalled);
+  Packet_t oldest = { .len = later.frame[0].len, .buf = later.frame[0].buf };
+  PacketReceived(&stalled, &oldest);
+  if (m_paramWrittenCalls != writtenCalls + 1 || stalled.txStats.replayed != 1) {
+    fprintf(stderr, "response_cache: cached response lost to a dropped one\n");
+    exit(1);
+  }
+  PacketReceived(&stalled, &dropped);
+  if (m_paramWrittenCalls != writtenCalls + 2 || stalled.txStats.replayed != 1) {
+    fprintf(stderr, "response_cache: dropped response replayed\n");
+    exit(1);
+  }
+
+  ApsRequest_t *req;
+  while ((req = ApsRequestNextPending()) != NULL) {
+    ApsRequestConfirm(req, APS_STATUS_SUCCESS);
+  }
+  while (ApsConfirmPeek() != NULL) {
+    ApsConfirmFree();
+  }
+  ApsRequestResetStats();
+  ParamSetU8(PARAM_ID_PERMIT_JOIN, 0);
+  ParamTakeWritten(&(uint8_t) { 0 });
+  HostParamWritten = NULL;
+  HostApsRequestReady = RunStack;
+}
+
+// Host side of a fragmented response: puts the FRAGMENTs back together.
+typedef struct {
+  uint8_t   buf[PACKET_FRAGMENTED_MAX_LEN];
+  size_t    len;
+  size_t    pieces;
+  size_t    others;   // frames which weren't FRAGMENTs
+  Frame_t   other;    // the last of them
+  bool      bad;      // a piece didn't follow on from the previous one
+} Reassembly_t;
+
+static void ReassembleFrame(const Packet_t *packet, void *context) {
+  Reassembly_t *r = context;
+  const FragmentHeader_t *frag = (const FragmentHeader_t *)packet->buf;
+  if (packet->buf[0] != FRAGMENT || packet->buf[2] != STATUS_SUCCESS) {
+    r->others++;
+    r->other.len = packet->len;
+    memcpy(r->other.buf, packet->buf, packet->len);
+    return;
+  }
+  size_t dataLen = packet->len - 2 - sizeof(*frag);
+  if (packet->len > MAX_PACKET_LEN || frag->offset != r->len ||
+      frag->offset + dataLen > frag->totalLen || frag->totalLen > sizeof(r->buf) ||
+      (r->len > 0 && frag->hdr.seqNum != r->buf[1])) {
+    r->bad = true;
+    return;
+  }
+  memcpy(&r->buf[r->len], &packet->buf[sizeof(*frag)], dataLen);
+  r->len += dataLen;
+  r->pieces++;
+}
+
+// Sends each of the frames in mix (which may be FRAGMENTs of one
+// request) and puts the response back together in r.
+static void ExchangeFragments(const Mix_t *mix, Reassembly_t *r) {
+  memset(r, 0, sizeof(*r));
+  SLIP_initParser(&m_captureParser, ReassembleFrame, r);
+  HostWriteResponse = CaptureResponse;
+  for (size_t i = 0; i < mix->numFrames; i++) {
+    uint8_t buf[MAX_FRAME_LEN];
+    Packet_t pkt = { .len = mix->frame[i].len, .buf = buf };
+    memcpy(buf, mix->frame[i].buf, pkt.len);
+    PacketReceived(&m_port, &pkt);
+  }
+  HostWriteResponse = NULL;
+}
+
+// Splits a frame (header and payload) into FRAGMENTs carrying pieceLen
+// bytes each.
+static void AddFragments(Mix_t *mix, const uint8_t *frame, size_t frameLen, size_t pieceLen) {
+  uint8_t seqNum = m_seqNum;
+  for (size_t offset = 0; offset < frameLen; offset += pieceLen) {
+    size_t len = frameLen - offset < pieceLen ? frameLen - offset : pieceLen;
+    uint8_t payload[4 + FRAGMENT_MAX_DATA];
+    payload[0] = frameLen & 0xff;
+    payload[1] = frameLen >> 8;
+    payload[2] = offset & 0xff;
+    payload[3] = offset >> 8;
+    memcpy(&payload[4], &frame[offset], len);
+    m_seqNum = seqNum;
+    AddFrame(mix, FRAGMENT, payload, 4 + len);
+  }
+}
+
+// Makes sure that responses longer than MAX_PACKET_LEN come out as
+// FRAGMENTs which go back together (including when they wrap around the
+// end of the TX queue), and that requests sent as FRAGMENTs are handled
+// once they're complete.
+static void VerifyFragments(void) {
+  static Mix_t requests = { .name = "fragments" };
+  static Reassembly_t r;
+  static Reassembly_t single;
+
+  // Every parameter three times over
+  uint8_t ids[3 * MAX_PACKET_LEN];
+  size_t numIds = 0;
+  for (int copy = 0; copy < 3; copy++) {
+    for (size_t i = 0; i < ParamCount(); i++) {
+      ids[numIds++] = ParamIdAt(i);
+    }
+  }
+  requests.numFrames = 0;
+  AddReadParameters(&requests, NULL, 0);
+  Frame_t snapshot = Exchange(&requests.frame[0]);
+  size_t snapshotLen = snapshot.len - 9;
+
+  uint32_t fragments = m_port.txStats.fragments;
+  for (int pass = 0; pass < 8; pass++) {
+    requests.numFrames = 0;
+    AddReadParameters(&requests, ids, numIds);
+    ExchangeFragments(&requests, &r);
+    size_t frameLen = 7 + 3 * snapshotLen;
+    bool ok = !r.bad && r.others == 0 && r.len == frameLen &&
+              r.pieces == (frameLen + FRAGMENT_MAX_DATA - 1) / FRAGMENT_MAX_DATA &&
+              r.buf[0] == READ_PARAMETERS && r.buf[1] == requests.frame[0].buf[1] &&
+              r.buf[2] == STATUS_SUCCESS && r.buf[3] + (r.buf[4] << 8) == frameLen &&
+              r.buf[5] + (r.buf[6] << 8) == 3 * snapshotLen;
+    for (int copy = 0; ok && copy < 3; copy++) {
+      ok = memcmp(&r.buf[7 + copy * snapshotLen], &snapshot.buf[7], snapshotLen) == 0;
+    }
+    if (!ok) {
+      fprintf(stderr, "fragments: response %d didn't go back together\n", pass);
+      exit(1);
+    }
+  }
+  if (m_port.txStats.fragments - fragments != 8 * r.pieces) {
+    fprintf(stderr, "fragments: %u FRAGMENTs counted\n", m_port.txStats.fragments - fragments);
+    exit(1);
+  }
+
+  // A request too long for one frame, in pieces of a few sizes
+  uint8_t frame[PACKET_FRAGMENTED_MAX_LEN];
+  size_t idCount = 2 * MAX_PACKET_LEN;
+  if (idCount > (PACKET_FRAGMENTED_MAX_LEN - 7) / 3) {
+    idCount = (PACKET_FRAGMENTED_MAX_LEN - 7) / 3;
+  }
+  size_t frameLen = sizeof(PacketHeader_t) + 2 + idCount;
+  frame[0] = READ_PARAMETERS;
+  frame[2] = 0;
+  frame[3] = frameLen & 0xff;
+  frame[4] = frameLen >> 8;
+  frame[5] = idCount & 0xff;
+  frame[6] = idCount >> 8;
+  for (size_t i = 0; i < idCount; i++) {
+    frame[7 + i] = i & 1 ? PARAM_ID_SECURITY_MODE : PARAM_ID_OPERATING_CHANNEL;
+  }
+  static const size_t pieceLen[] = { 3, 40, FRAGMENT_MAX_DATA };
+  for (size_t i = 0; i < ARRAY_LEN(pieceLen); i++) {
+    requests.numFrames = 0;
+    frame[1] = m_seqNum;
+    AddFragments(&requests, frame, frameLen, pieceLen[i]);
+    ExchangeFragments(&requests, &r);
+    bool ok = !r.bad && r.others == 0 && r.len == 7 + 3 * idCount && r.buf[0] == READ_PARAMETERS;
+    for (size_t j = 0; ok && j < idCount; j++) {
+      ok = r.buf[7 + 3 * j] == frame[7 + j] && r.buf[8 + 3 * j] == 1;
+    }
+    if (!ok) {
+      fprintf(stderr, "fragments: request in %zu byte pieces not handled\n", pieceLen[i]);
+      exit(1);
+    }
+  }
+
+  // A piece missing from the middle, and a request which fits in one
+  // frame after all
+  requests.numFrames = 0;
+  AddFragments(&requests, frame, frameLen, 40);
+  memmove(&requests.frame[2], &requests.frame[3],
+          (requests.numFrames - 3) * sizeof(requests.frame[0]));
+  requests.numFrames--;
+  ExchangeFragments(&requests, &r);
+  if (r.others == 0 || r.other.buf[0] != FRAGMENT || r.other.buf[2] != STATUS_INVALID_VALUE ||
+      r.pieces != 0) {
+    fprintf(stderr, "fragments: missing piece not noticed\n");
+    exit(1);
+  }
+  requests.numFrames = 0;
+  frameLen = sizeof(PacketHeader_t) + 2;
+  uint8_t small[] = { READ_PARAMETERS, m_seqNum, 0, frameLen, 0, 0, 0 };
+  AddFragments(&requests, small, sizeof(small), 3);
+  ExchangeFragments(&requests, &single);
+  if (single.others != 1 || single.other.buf[0] != READ_PARAMETERS ||
+      single.other.len != snapshot.len || memcmp(&single.other.buf[2], &snapshot.buf[2], snapshot.len - 4) != 0) {
+    fprintf(stderr, "fragments: fragmented request for a short response not handled\n");
+    exit(1);
+  }
+}
+
+static size_t EncodedLen(const Frame_t *frame) {
+  uint8_t encoded[MAX_FRAME_LEN * 2 + 2];
+  Packet_t pkt = { .len = frame->len, .buf = (uint8_t *)frame->buf };
+  return SLIP_encapsulate(&pkt, encoded, sizeof(encoded));
+}
+
+// Makes sure that READ_PARAMETERS answers with the same values as a
+// READ_PARAMETER for each ID, and compares the bytes on the wire with
+// the tester's startup reads.
+static void VerifyReadParameters(void) {
+  static Mix_t requests = { .name = "read_parameters" };
+  static const uint8_t startup[] = {
+    PARAM_ID_MAC_ADRESS, PARAM_ID_PAN_ID64, PARAM_ID_SCAN_CHANNELS, PARAM_ID_OPERATING_CHANNEL
+  };
+  uint8_t snapshot[MAX_PACKET_LEN];
+  for (size_t i = 0; i < ParamCount(); i++) {
+    snapshot[i] = ParamIdAt(i);
+  }
+  uint8_t unknown[] = { PARAM_ID_PAN_ID16, 0xee, PARAM_ID_SECURITY_MODE };
+
+  AddReadParameters(&requests, startup, sizeof(startup));
+  AddReadParameters(&requests, NULL, 0);
+  AddReadParameters(&requests, unknown, sizeof(unknown));
+  const uint8_t *ids[] = { startup, snapshot, unknown };
+  size_t numIds[] = { sizeof(startup), ParamCount(), sizeof(unknown) };
+
+  size_t singleBytes = 0;
+  for (size_t r = 0; r < ARRAY_LEN(ids); r++) {
+    Frame_t response = Exchange(&requests.frame[r]);
+    bool ok = response.len >= 9 && response.buf[0] == READ_PARAMETERS &&
+              response.buf[1] == requests.frame[r].buf[1] &&
+              response.buf[2] == STATUS_SUCCESS &&
+              response.buf[5] + (response.buf[6] << 8) == response.len - 9;
+    size_t pos = 7;
+    for (size_t i = 0; ok && i < numIds[r]; i++) {
+      static Mix_t single = { .name = "read_parameter" };
+      single.numFrames = 0;
+      AddReadParameter(&single, ids[r][i]);
+      Frame_t expect = Exchange(&single.frame[0]);
+      size_t len = expect.buf[2] == STATUS_SUCCESS ? expect.buf[5] - 1 : 0;
+      ok = pos + 2 + len <= response.len - 2 && response.buf[pos] == ids[r][i] &&
+           response.buf[pos + 1] == len && memcmp(&response.buf[pos + 2], &expect.buf[8], len) == 0;
+      pos += 2 + len;
+      if (r == 0) {
+        singleBytes += EncodedLen(&single.frame[0]) + EncodedLen(&expect);
+      }
+    }
+    if (!ok || pos != response.len - 2) {
+      fprintf(stderr, "read_parameters: request %zu answered wrong\n", r);
+      exit(1);
+    }
+    if (r == 0) {
+      printf("%-32s %8zu bytes for %zu READ_PARAMETERs, %zu for one READ_PARAMETERS\n",
+             "read_parameters/startup", singleBytes, numIds[r],
+             EncodedLen(&requests.frame[r]) + EncodedLen(&response));
+    }
+  }
+
+  // Too many values for one frame, and a list that doesn't match its length
+  uint8_t tooMany[PACKET_FRAGMENTED_MAX_LEN / (2 + 16) + 1];
+  memset(tooMany, PARAM_ID_NETWORK_KEY, sizeof(tooMany));
+  AddReadParameters(&requests, tooMany, sizeof(tooMany));
+  uint8_t badLen[] = { 3, 0, PARAM_ID_MAC_ADRESS };
+  AddFrame(&requests, READ_PARAMETERS, badLen, sizeof(badLen));
+  for (size_t r = 3; r < requests.numFrames; r++) {
+    Frame_t response = Exchange(&requests.frame[r]);
+    if (response.len != 7 || response.buf[2] != STATUS_INVALID_VALUE) {
+      fprintf(stderr, "read_parameters: bad request %zu not rejected\n", r);
+      exit(1);
+    }
+  }
+}
+
+// Makes sure that responses generated while the endpoint is busy are
+// queued (wrapping around the end of the queue) and come out in order,
+// and that the ones which don't fit are counted.
+static void VerifyTxQueue(void) {
+  static Mix_t requests = { .name = "tx_queue" };
+  static Mix_t sent = { .name = "tx_queue" };
+  static PacketPort_t port;
+  PacketPortInit(&port, StalledTxReady, NULL);
+
+  uint8_t seqNum = m_seqNum;
+  AddReadParameter(&requests, PARAM_ID_MAC_ADRESS);
+  Frame_t response = Exchange(&requests.frame[0]);
+  size_t maxQueued = PACKET_TX_QUEUE_SIZE / (response.len - 2);
+
+  if (maxQueued + 3 > MAX_FRAMES) {
+    fprintf(stderr, "tx_queue: PACKET_TX_QUEUE_SIZE too big for the test\n");
+    exit(1);
+  }
+
+  // Half fill the queue and drain it first, so that the rest wraps.
+  for (int pass = 0; pass < 2; pass++) {
+    size_t numRequests = pass == 0 ? maxQueued / 2 : maxQueued + 3;
+    requests.numFrames = 0;
+    sent.numFrames = 0;
+    m_rcvdFrames = 0;
+    m_rcvdMismatch = false;
+    for (size_t i = 0; i < numRequests; i++) {
+      // Each response carries its request's seqNum
+      m_seqNum = i;
+      AddReadParameter(&requests, PARAM_ID_MAC_ADRESS);
+      Packet_t pkt = { .len = requests.frame[i].len, .buf = requests.frame[i].buf };
+      PacketReceived(&port, &pkt);
+      if (i < maxQueued) {
+        m_seqNum = i;
+        AddFrame(&sent, response.buf[0], &response.buf[5], response.len - 7);
+      }
+    }
+    m_expectMix = &sent;
+    SLIP_initParser(&m_captureParser, CheckFrame, NULL);
+    DrainPort(&port);
+    m_expectMix = NULL;
+    size_t expectFrames = numRequests < maxQueued ? numRequests : maxQueued;
+    if (m_rcvdMismatch || m_rcvdFrames != expectFrames || port.txUsed != 0) {
+      fprintf(stderr, "tx_queue: %zu of %zu responses%s\n", m_rcvdFrames,
+              expectFrames, m_rcvdMismatch ? " with mismatches" : "");
+      exit(1);
+    }
+  }
+  m_seqNum = seqNum;
+  if (port.txStats.overflow != 3 ||
+      port.txStats.highWater != maxQueued * (response.len - 2)) {
+    fprintf(stderr, "tx_queue: %u overflows, high water %u\n",
+            port.txStats.overflow, port.txStats.highWater);
+    exit(1);
+  }
+
+  // A flush part way through a response (the host went away) leaves
+  // nothing behind, and the next response goes out whole.
+  uint8_t txBuf[4];
+  for (size_t i = 0; i < 3; i++) {
+    Packet_t pkt = { .len = requests.frame[i].len, .buf = requests.frame[i].buf };
+    PacketReceived(&port, &pkt);
+  }
+  PacketTxFill(&port, txBuf, sizeof(txBuf));
+  PacketTxFlush(&port);
+  if (port.txUsed != 0 || PacketTxFill(&port, txBuf, sizeof(txBuf)) != 0) {
+    fprintf(stderr, "tx_queue: %u bytes left after a flush\n", port.txUsed);
+    exit(1);
+  }
+  requests.numFrames = 0;
+  sent.numFrames = 0;
+  m_rcvdFrames = 0;
+  m_rcvdMismatch = false;
+  AddReadParameter(&requests, PARAM_ID_MAC_ADRESS);
+  m_seqNum = seqNum;
+  AddFrame(&sent, response.buf[0], &response.buf[5], response.len - 7);
+  m_seqNum = seqNum;
+  Packet_t pkt = { .len = requests.frame[0].len, .buf = requests.frame[0].buf };
+  PacketReceived(&port, &pkt);
+  m_expectMix = &sent;
+  SLIP_initParser(&m_captureParser, CheckFrame, NULL);
+  DrainPort(&port);
+  m_expectMix = NULL;
+  if (m_rcvdMismatch || m_rcvdFrames != 1) {
+    fprintf(stderr, "tx_queue: %zu responses after a flush%s\n", m_rcvdFrames,
+            m_rcvdMismatch ? " with mismatches" : "");
+    exit(1);
+  }
+}
+
+// Makes sure that a burst of responses which built up while the
+// endpoint was busy goes out in as few transfers as possible.
+static void VerifyCoalescing(const Mix_t *mix) {
+  static PacketPort_t port;
+  static uint8_t txBuf[PACKET_TX_TRANSFER_SIZE];
+  PacketPortInit(&port, StalledTxReady, NULL);
+
+  for (size_t i = 0; i < mix->numFrames; i++) {
+    Packet_t pkt = { .len = mix->frame[i].len, .buf = (uint8_t *)mix->frame[i].buf };
+    PacketReceived(&port, &pkt);
+  }
+  SLIP_initParser(&m_captureParser, CountFrame, NULL);
+  m_rcvdFrames = 0;
+  size_t bytes = 0;
+  size_t transfers = 0;
+  size_t txLen;
+  while ((txLen = PacketTxFill(&port, txBuf, sizeof(txBuf))) > 0) {
+    SLIP_parseChunk(&m_captureParser, txBuf, txLen);
+    bytes += txLen;
+    transfers++;
+  }
+  size_t minTransfers = (bytes + sizeof(txBuf) - 1) / sizeof(txBuf);
+  if (m_rcvdFrames != mix->numFrames || transfers != minTransfers ||
+      port.txStats.transfers != transfers) {
+    fprintf(stderr, "%s: %zu responses (%zu bytes) took %zu transfers\n",
+            mix->name, m_rcvdFrames, bytes, transfers);
+    exit(1);
+  }
+}
+
+// Stands in for a USB read finishing: fills the port's next RX buffer
+// the way the USB DMA does on the target. Returns false if the port had
+// no buffer to read into.
+static bool ReadInto(PacketPort_t *port, const uint8_t *data, size_t len) {
+  uint8_t *buf = PacketPortRxBuffer(port);
+  if (buf == NULL) {
+    return false;
+  }
+  memcpy(buf, data, len);
+  PacketPortRxDone(port, len);
+  return true;
+}
+
+// Makes sure that the RX buffers are handed to the parser in the order
+// they were read into (across the index wrap), and that running out of
+// them is counted and recovered from.
+static void VerifyRxRing(const Mix_t *mix) {
+  static PacketPort_t port;
+  PacketPortInit(&port, StalledTxReady, NULL);
+  SLIP_initParser(&port.parser, CheckFrame, NULL);
+  // Start close to the point where the free running indices wrap.
+  port.rxHead = port.rxTail = UINT16_MAX - PACKET_RX_RING_SIZE / 2;
+
+  m_expectMix = mix;
+  m_rcvdFrames = 0;
+  m_rcvdBytes = 0;
+  m_rcvdMismatch = false;
+  size_t numReads = 0;
+  size_t bytes = 0;
+  for (size_t offset = 0; offset < mix->streamLen; offset += CHUNK_SIZE) {
+    size_t chunkLen = mix->streamLen - offset;
+    if (chunkLen > CHUNK_SIZE) {
+      chunkLen = CHUNK_SIZE;
+    }
+    // Alternate between letting every buffer fill up and handling each
+    // one as it arrives.
+    if (!ReadInto(&port, &mix->stream[offset], chunkLen)) {
+      if ((uint16_t)(port.rxHead - port.rxTail) != PACKET_RX_RING_SIZE ||
+          !port.rxStarved) {
+        fprintf(stderr, "rx_ring: no buffer with one free\n");
+        exit(1);
+      }
+      PacketPortProcessRx(&port);
+      if (!ReadInto(&port, &mix->stream[offset], chunkLen) || port.rxStarved) {
+        fprintf(stderr, "rx_ring: still starved after handling the buffers\n");
+        exit(1);
+      }
+    } else if ((numReads / PACKET_RX_RING_SIZE) & 1) {
+      PacketPortProcessRx(&port);
+    }
+    numReads++;
+    bytes += chunkLen;
+  }
+  PacketPortProcessRx(&port);
+  const PacketRxStats_t *stats = &port.rxStats;
+  if (m_rcvdMismatch || m_rcvdFrames != mix->numFrames ||
+      stats->buffers != numReads || stats->handled != numReads ||
+      stats->bytes != bytes || PacketPortProcessRx(&port)) {
+    fprintf(stderr, "rx_ring: %zu of %zu frames (mismatch %d), %lu of %zu buffers handled\n",
+            m_rcvdFrames, mix->numFrames, m_rcvdMismatch,
+            (unsigned long)stats->handled, numReads);
+    exit(1);
+  }
+  if (numReads > 2 * PACKET_RX_RING_SIZE &&
+      (stats->starved == 0 || stats->highWater != PACKET_RX_RING_SIZE)) {
+    fprintf(stderr, "rx_ring: starvation not counted\n");
+    exit(1);
+  }
+  if (stats->maxLatency == 0 || stats->latency < stats->maxLatency) {
+    fprintf(stderr, "rx_ring: latency not measured\n");
+    exit(1);
+  }
+}
+
+// The port which DEVICE_STATE_CHANGED gets pushed to.
+static PacketPort_t *m_statePort = &m_port;
+
+static void PushDeviceState(uint8_t deviceState) {
+  PacketSendDeviceStateChanged(m_statePort, deviceState);
+}
+
+// Makes sure that DEVICE_STATE reports the cached state, and that a
+// DEVICE_STATE_CHANGED is pushed when (and only when) it changes.
+static void VerifyDeviceState(void) {
+  static Mix_t requests = { .name = "device_state" };
+  AddDeviceState(&requests);
+  const Frame_t *request = &requests.frame[0];
+
+  uint8_t initialState = DeviceStateGet();
+  DeviceStateSetNetwork(DEVICE_STATE_NET_OFFLINE);
+  uint8_t otherFlags = DeviceStateGet() & ~DEVICE_STATE_APS_DATA_INDICATION;
+
+  HostDeviceStateChanged = PushDeviceState;
+  for (int i = 0; i < 3; i++) {
+    uint8_t deviceState = otherFlags | DEVICE_STATE_NET_CONNECTED | DEVICE_STATE_APS_DATA_INDICATION;
+    Frame_t response;
+    unsigned long responses = HostResponseCount;
+    switch (i) {
+      case 0:
+        DeviceStateSetNetwork(DEVICE_STATE_NET_CONNECTED);
+        DeviceStateSetFlag(DEVICE_STATE_APS_DATA_INDICATION, 1);
+        break;
+      case 1:
+        DeviceStateSetFlag(DEVICE_STATE_APS_DATA_INDICATION, 1);  // no change
+        break;
+      case 2:
+        DeviceStateSetFlag(DEVICE_STATE_APS_DATA_INDICATION, 0);
+        deviceState = otherFlags | DEVICE_STATE_NET_CONNECTED;
+        break;
+    }
+    unsigned long pushed = HostResponseCount - responses;
+    response = Exchange(request);
+    if (response.len != 10 || response.buf[0] != DEVICE_STATE ||
+        response.buf[5] != deviceState || pushed != (i == 0 ? 2 : i == 1 ? 0 : 1)) {
+      fprintf(stderr, "device_state: 0x%02x expected 0x%02x (%lu changes pushed)\n",
+              response.buf[5], deviceState, pushed);
+      exit(1);
+    }
+  }
+  HostDeviceStateChanged = NULL;
+  DeviceStateUpdate(0xff, initialState);
+}
+
+// Makes sure that APS_DATA_REQUESTs are accepted until every slot is
+// in use, that the confirms come back in the order ZBOSS produced them
+// (carrying the right requestId and destination), and that the device
+// state follows the free slots and waiting confirms.
+static void VerifyApsRequest(void) {
+  static Mix_t requests = { .name = "aps_request" };
+  static Mix_t confirm = { .name = "aps_request" };
+  static Mix_t deviceState = { .name = "aps_request" };
+  static const uint8_t status[] = { APS_STATUS_SUCCESS, APS_STATUS_NO_ACK };
+  ApsRequest_t *sent[APS_REQUEST_QUEUE_SIZE];
+  uint8_t seqNum = m_seqNum;
+
+  // Nothing gets sent until we say so.
+  HostApsRequestReady = NULL;
+  ApsRequestResetStats();
+  requests.numFrames = 0;
+  for (size_t i = 0; i <= APS_REQUEST_QUEUE_SIZE; i++) {
+    AddApsDataRequest(&requests, 0x40 + i, i & 1 ? APS_ADDR_MODE_IEEE : APS_ADDR_MODE_NWK);
+    Frame_t response = Exchange(&requests.frame[i]);
+    bool full = i == APS_REQUEST_QUEUE_SIZE;
+    if (full ? response.buf[2] != STATUS_BUSY :
+               (response.len != 11 || response.buf[2] != STATUS_SUCCESS ||
+                response.buf[8] != 0x40 + i ||
+                ((response.buf[7] & DEVICE_STATE_APS_DATA_REQUEST) != 0) != (i + 1 < APS_REQUEST_QUEUE_SIZE))) {
+      fprintf(stderr, "aps_request: unexpected response to request %zu\n", i);
+      exit(1);
+    }
+  }
+  AddDeviceState(&deviceState);
+  Frame_t response = Exchange(&deviceState.frame[0]);
+  if (response.buf[6] != 0 || (response.buf[5] & DEVICE_STATE_APS_DATA_REQUEST) != 0) {
+    fprintf(stderr, "aps_request: %u free slots reported with a full window\n", response.buf[6]);
+    exit(1);
+  }
+
+  // ZBOSS takes them in order, but confirms them in reverse.
+  for (size_t i = 0; i < APS_REQUEST_QUEUE_SIZE; i++) {
+    sent[i] = ApsRequestNextPending();
+    if (sent[i] == NULL || sent[i]->requestId != 0x40 + i) {
+      fprintf(stderr, "aps_request: request %zu sent out of order\n", i);
+      exit(1);
+    }
+  }
+  for (size_t i = APS_REQUEST_QUEUE_SIZE; i-- > 0; ) {
+    ApsRequestConfirm(sent[i], status[i & 1]);
+  }
+  AddApsDataConfirmRequest(&confirm);
+  for (size_t i = APS_REQUEST_QUEUE_SIZE; i-- > 0; ) {
+    Frame_t response = Exchange(&confirm.frame[0]);
+    const Frame_t *request = &requests.frame[i];
+    size_t addrLen = i & 1 ? 9 : 3;   // address + endpoint
+    uint8_t flags = DEVICE_STATE_APS_DATA_REQUEST | (i > 0 ? DEVICE_STATE_APS_DATA_CONFIRM : 0);
+    if (response.len != 5 + 2 + 3 + addrLen + 2 + 4 + 2 || response.buf[2] != STATUS_SUCCESS ||
+        (response.buf[7] & (DEVICE_STATE_APS_DATA_REQUEST | DEVICE_STATE_APS_DATA_CONFIRM)) != flags ||
+        response.buf[8] != 0x40 + i || memcmp(&response.buf[9], &request->buf[9], 1 + addrLen) != 0 ||
+        response.buf[10 + addrLen] != 0 || response.buf[11 + addrLen] != status[i & 1]) {
+      fprintf(stderr, "aps_request: confirm for request %zu came back wrong\n", i);
+      exit(1);
+    }
+  }
+  response = Exchange(&confirm.frame[0]);
+  const ApsRequestStats_t *stats = ApsRequestGetStats();
+  if (response.buf[2] != STATUS_FAILURE || ApsRequestFreeSlots() != APS_REQUEST_QUEUE_SIZE ||
+      (DeviceStateGet() & DEVICE_STATE_APS_DATA_CONFIRM) != 0 || stats->busy != 1 ||
+      stats->failed != APS_REQUEST_QUEUE_SIZE / 2 || stats->delivered != APS_REQUEST_QUEUE_SIZE) {
+    fprintf(stderr, "aps_request: window not emptied\n");
+    exit(1);
+  }
+
+  // Requests which can't be sent
+  requests.numFrames = 0;
+  uint8_t badMode[] = { 0x0c, 0, 0x50, 0, 0x07, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+  AddFrame(&requests, APS_DATA_REQUEST, badMode, sizeof(badMode));
+  AddApsDataRequest(&requests, 0x51, APS_ADDR_MODE_NWK);
+  requests.frame[1].buf[3]--;   // lose the radius
+  requests.frame[1].len--;
+  AddApsDataRequest(&requests, 0x52, APS_ADDR_MODE_NWK);
+  static const uint8_t expectStatus[] = {
+    STATUS_INVALID_VALUE, STATUS_INVALID_VALUE, STATUS_NO_NETWORK
+  };
+  uint8_t netState = DeviceStateGet() & DEVICE_STATE_NET_MASK;
+  for (size_t i = 0; i < requests.numFrames; i++) {
+    Frame_t *request = &requests.frame[i];
+    if (i == 1) {
+      // Fix up the CRC after the truncation.
+      uint16_t crc = 0;
+      for (size_t j = 0; j < request->len - 2; j++) {
+        crc += request->buf[j];
+      }
+      crc = ~crc + 1;
+      request->buf[request->len - 2] = crc & 0xff;
+      request->buf[request->len - 1] = crc >> 8;
+    }
+    if (i == 2) {
+      DeviceStateSetNetwork(DEVICE_STATE_NET_OFFLINE);
+    }
+    Frame_t response = Exchange(request);
+    if (response.len < 7 || response.buf[2] != expectStatus[i]) {
+      fprintf(stderr, "aps_request: no status %u response to bad request %zu\n",
+              expectStatus[i], i);
+      exit(1);
+    }
+  }
+  DeviceStateSetNetwork(netState);
+  if (ApsRequestFreeSlots() != APS_REQUEST_QUEUE_SIZE) {
+    fprintf(stderr, "aps_request: bad requests took up slots\n");
+    exit(1);
+  }
+
+  // A request whose response can't be queued isn't carried out, so that
+  // the host's retry doesn't send it twice.
+  static PacketPort_t stalled;
+  PacketPortInit(&stalled, StalledTxReady, NULL);
+  requests.numFrames = 0;
+  AddReadParameter(&requests, PARAM_ID_MAC_ADRESS);
+  AddApsDataRequest(&requests, 0x53, APS_ADDR_MODE_NWK);
+  Packet_t fill = { .len = requests.frame[0].len, .buf = requests.frame[0].buf };
+  while (stalled.txStats.overflow == 0) {
+    PacketReceived(&stalled, &fill);
+  }
+  uint32_t submitted = stats->submitted;
+  Packet_t pkt = { .len = requests.frame[1].len, .buf = requests.frame[1].buf };
+  PacketReceived(&stalled, &pkt);
+  if (stats->submitted != submitted || ApsRequestFreeSlots() != APS_REQUEST_QUEUE_SIZE) {
+    fprintf(stderr, "aps_request: request carried out without a response\n");
+    exit(1);
+  }
+  SLIP_initParser(&m_captureParser, CountFrame, NULL);
+  DrainPort(&stalled);
+  PacketReceived(&stalled, &pkt);
+  if (stats->submitted != submitted + 1 || stalled.txUsed == 0) {
+    fprintf(stderr, "aps_request: retry after a full TX queue not carried out\n");
+    exit(1);
+  }
+  ApsRequestConfirm(ApsRequestNextPending(), APS_STATUS_SUCCESS);
+  ApsConfirmFree();
+
+  // Taking the last slot pushes a DEVICE_STATE_CHANGED onto the same
+  // port first, so room for the response alone isn't enough.
+  requests.numFrames = 0;
+  for (size_t i = 0; i + 1 < APS_REQUEST_QUEUE_SIZE; i++) {
+    AddApsDataRequest(&requests, 0x60 + i, APS_ADDR_MODE_NWK);
+    Exchange(&requests.frame[i]);
+  }
+  size_t apsRequest = requests.numFrames;
+  AddApsDataRequest(&requests, 0x54, APS_ADDR_MODE_NWK);
+  size_t readChannel = requests.numFrames;
+  AddReadParameter(&requests, PARAM_ID_OPERATING_CHANNEL);   // 9 byte response
+  AddDeviceState(&requests);                                  // 8 byte response
+  PacketPortInit(&stalled, StalledTxReady, NULL);
+  size_t responseLen = 9;
+  for (size_t i = readChannel; i <= readChannel + 1; i++) {
+    Packet_t fill = { .len = requests.frame[i].len, .buf = requests.frame[i].buf };
+    while (PACKET_TX_QUEUE_SIZE - stalled.txUsed > responseLen &&
+           (i > readChannel || (PACKET_TX_QUEUE_SIZE - stalled.txUsed - responseLen) % 8 != 0)) {
+      PacketReceived(&stalled, &fill);
+    }
+  }
+  m_statePort = &stalled;
+  HostDeviceStateChanged = PushDeviceState;
+  submitted = stats->submitted;
+  pkt.len = requests.frame[apsRequest].len;
+  pkt.buf = requests.frame[apsRequest].buf;
+  PacketReceived(&stalled, &pkt);
+  if (PACKET_TX_QUEUE_SIZE - stalled.txUsed != responseLen ||
+      stats->submitted != submitted || ApsRequestFreeSlots() != 1) {
+    fprintf(stderr, "aps_request: request carried out with room for its response only\n");
+    exit(1);
+  }
+  SLIP_initParser(&m_captureParser, CountFrame, NULL);
+  DrainPort(&stalled);
+  PacketReceived(&stalled, &pkt);
+  if (stats->submitted != submitted + 1 ||
+      stalled.txUsed != sizeof(PacketHeader_t) + 1 + responseLen) {
+    fprintf(stderr, "aps_request: no response and DEVICE_STATE_CHANGED for the last slot\n");
+    exit(1);
+  }
+  HostDeviceStateChanged = NULL;
+  m_statePort = &m_port;
+  while ((sent[0] = ApsRequestNextPending()) != NULL) {
+    ApsRequestConfirm(sent[0], APS_STATUS_SUCCESS);
+  }
+  while (ApsRequestFreeSlots() != APS_REQUEST_QUEUE_SIZE) {
+    ApsConfirmFree();
+  }
+  HostApsRequestReady = RunStack;
+  m_seqNum = seqNum;
+}
+
+// Makes sure that queued indications come back out of
+// APS_DATA_INDICATION in order and in the expected format, that
+// DEVICE_STATE_APS_DATA_INDICATION tracks whether any are left, and
+// that a full queue drops according to APS_INDICATION_DROP_OLDEST.
+static void VerifyApsIndication(const Mix_t *mix) {
+  static Mix_t requests = { .name = "aps_indication" };
+  static Mix_t expect = { .name = "aps_indication" };
+  uint8_t seqNum = m_seqNum;
+
+  ApsIndicationResetStats();
+  for (size_t i = 0; i < mix->numFrames; i++) {
+    const Frame_t *frame = &mix->frame[i];
+    if (frame->buf[0] != APS_DATA_INDICATION) {
+      continue;
+    }
+    QueueIndication(frame);
+    if ((DeviceStateGet() & DEVICE_STATE_APS_DATA_INDICATION) == 0) {
+      fprintf(stderr, "aps_indication: device state flag not set\n");
+      exit(1);
+    }
+    requests.numFrames = 0;
+    expect.numFrames = 0;
+    m_seqNum = frame->buf[1];
+    AddApsDataIndicationRequest(&requests);
+    uint8_t payload[MAX_FRAME_LEN];
+    memcpy(payload, &frame->buf[5], frame->len - 7);
+    payload[2] = DeviceStateGet() & ~DEVICE_STATE_APS_DATA_INDICATION;
+    m_seqNum = frame->buf[1];
+    AddFrame(&expect, APS_DATA_INDICATION, payload, frame->len - 7);
+
+    Frame_t response = Exchange(&requests.frame[0]);
+    if (response.len != expect.frame[0].len ||
+        memcmp(response.buf, expect.frame[0].buf, response.len) != 0 ||
+        (DeviceStateGet() & DEVICE_STATE_APS_DATA_INDICATION) != 0) {
+      fprintf(stderr, "aps_indication: frame %zu came back differently\n", i);
+      exit(1);
+    }
+  }
+
+  // Overfill the queue with indications numbered by source address.
+  Frame_t frame = *FirstFrame(mix, APS_DATA_INDICATION);
+  size_t numQueued = APS_INDICATION_QUEUE_SIZE + 2;
+  size_t queued = 0;
+  for (size_t i = 0; i < numQueued; i++) {
+    frame.buf[13] = i;
+    frame.buf[14] = 0;
+    queued += QueueIndication(&frame);
+  }
+  size_t expectFirst = APS_INDICATION_DROP_OLDEST ? numQueued - APS_INDICATION_QUEUE_SIZE : 0;
+  size_t expectQueued = APS_INDICATION_DROP_OLDEST ? numQueued : APS_INDICATION_QUEUE_SIZE;
+  const ApsIndicationStats_t *stats = ApsIndicationGetStats();
+  if (queued != expectQueued || stats->dropped != numQueued - APS_INDICATION_QUEUE_SIZE ||
+      stats->highWater != APS_INDICATION_QUEUE_SIZE) {
+    fprintf(stderr, "aps_indication: %zu queued, %u dropped\n", queued, stats->dropped);
+    exit(1);
+  }
+  requests.numFrames = 0;
+  AddApsDataIndicationRequest(&requests);
+  for (size_t i = 0; i <= APS_INDICATION_QUEUE_SIZE; i++) {
+    Frame_t response = Exchange(&requests.frame[0]);
+    bool last = i == APS_INDICATION_QUEUE_SIZE;
+    uint8_t status = last ? STATUS_FAILURE : STATUS_SUCCESS;
+    uint8_t flag = i + 1 < APS_INDICATION_QUEUE_SIZE ? DEVICE_STATE_APS_DATA_INDICATION : 0;
+    if (response.len < 7 || response.buf[2] != status ||
+        (!last && (response.buf[13] != expectFirst + i ||
+                   (response.buf[7] & DEVICE_STATE_APS_DATA_INDICATION) != flag))) {
+      fprintf(stderr, "aps_indication: read %zu of the full queue came back wrong\n", i);
+      exit(1);
+    }
+  }
+  if (ApsIndicationCount() != 0 || (DeviceStateGet() & DEVICE_STATE_APS_DATA_INDICATION) != 0 ||
+      stats->delivered != stats->received - stats->dropped) {
+    fprintf(stderr, "aps_indication: queue not drained\n");
+    exit(1);
+  }
+  m_seqNum = seqNum;
+}
+
+// Makes sure that oversize frames and bad escapes are dropped/counted
+// without upsetting the frames around them.
+static void VerifyNoise(void) {
+  static Mix_t noise = { .name = "noise" };
+  static const size_t chunkSize[] = { 1, 7, CHUNK_SIZE, sizeof(noise.stream) };
+  const Frame_t *good = &m_requests.frame[0];
+
+  uint8_t *dst = noise.stream;
+  memcpy(dst, m_requests.stream, m_requests.streamLen);
+  dst += m_requests.streamLen;
+  *dst++ = 0xc0;
+  for (int i = 0; i < MAX_PACKET_LEN + 50; i++) {
+    *dst++ = i & 0x7f;
+  }
+  *dst++ = 0xc0;
+  *dst++ = 0xdb;    // ESC followed by something other than ESC_END/ESC_ESC
+  *dst++ = 0x01;
+  *dst++ = 0xc0;
+  *dst++ = 0x02;
+  *dst++ = 0xdb;    // ESC followed by END, which still ends the frame
+  *dst++ = 0xc0;
+  Packet_t pkt = { .len = good->len, .buf = (uint8_t *)good->buf };
+  dst += SLIP_encapsulate(&pkt, dst, &noise.stream[sizeof(noise.stream)] - dst);
+  noise.streamLen = dst - noise.stream;
+
+  for (int inPlace = 0; inPlace <= 1; inPlace++) {
+    for (size_t i = 0; i < sizeof(chunkSize) / sizeof(chunkSize[0]); i++) {
+      SLIP_Parser_t parser;
+      SLIP_initParser(&parser, CountFrame, NULL);
+      m_rcvdFrames = 0;
+      FeedStreamChunks(&parser, &noise, inPlace, chunkSize[i]);
+      if (m_rcvdFrames != m_requests.numFrames + 2 ||
+          parser.stats.oversize != 1 || parser.stats.badEscape != 2) {
+        fprintf(stderr, "noise: %zu frames, %u oversize, %u bad escapes (%s, %zu byte chunks)\n",
+                m_rcvdFrames, parser.stats.oversize, parser.stats.badEscape,
+                inPlace ? "in place" : "copy", chunkSize[i]);
+        exit(1);
+      }
+    }
+  }
+}
+
+static void BenchDecode(const Mix_t *mix, bool inPlace) {
+  char name[64];
+  SLIP_Parser_t parser;
+  SLIP_initParser(&parser, CountFrame, NULL);
+  m_rcvdFrames = 0;
+  m_rcvdBytes = 0;
+  uint64_t start = NowNs();
+  for (int round = 0; round < m_rounds; round++) {
+    FeedStream(&parser, mix, inPlace);
+  }
+  uint64_t ns = NowNs() - start;
+  snprintf(name, sizeof(name), "slip_decode%s/%s",
+           inPlace ? "_inplace" : "", mix->name);
+  Report(name, ns, m_rcvdFrames, mix->streamLen * m_rounds);
+}
+
+static void BenchEncode(const Mix_t *mix) {
+  char name[64];
+  static uint8_t outBuf[MAX_FRAME_LEN * 2 + 2];
+  size_t bytes = 0;
+  uint64_t start = NowNs();
+  for (int round = 0; round < m_rounds; round++) {
+    for (size_t i = 0; i < mix->numFrames; i++) {
+      Packet_t pkt = { .len = mix->frame[i].len, .buf = (uint8_t *)mix->frame[i].buf };
+      bytes += SLIP_encapsulate(&pkt, outBuf, sizeof(outBuf));
+    }
+  }
+  uint64_t ns = NowNs() - start;
+  snprintf(name, sizeof(name), "slip_encode/%s", mix->name);
+  Report(name, ns, mix->numFrames * m_rounds, bytes);
+}
+
+static void BenchEncodev(const Mix_t *mix) {
+  char name[64];
+  static uint8_t outBuf[MAX_FRAME_LEN * 2 + 2];
+  SLIP_Segment_t seg[MAX_FRAMES][2];
+  size_t numSegs[MAX_FRAMES];
+  size_t bytes = 0;
+
+  for (size_t i = 0; i < mix->numFrames; i++) {
+    numSegs[i] = FrameSegments(&mix->frame[i], seg[i]);
+  }
+  uint64_t start = NowNs();
+  for (int round = 0; round < m_rounds; round++) {
+    for (size_t i = 0; i < mix->numFrames; i++) {
+      bytes += SLIP_encapsulatev(seg[i], numSegs[i], outBuf, sizeof(outBuf));
+    }
+  }
+  uint64_t ns = NowNs() - start;
+  snprintf(name, sizeof(name), "slip_encodev/%s", mix->name);
+  Report(name, ns, mix->numFrames * m_rounds, bytes);
+}
+
+// The mixes reuse their seqNums every round, which a real host (counting
+// up to 255) wouldn't, so the requests from the previous round mustn't
+// be taken for retries.
+static void ForgetResponses(PacketPort_t *port) {
+  for (size_t i = 0; i < PACKET_RESPONSE_CACHE_SIZE; i++) {
+    port->responseCache[i].len = 0;
+  }
+}
+
+static void BenchPacketReceived(const Mix_t *mix) {
+  // PacketReceived takes a const packet, but we copy anyway so each
+  // call sees a fresh buffer like it would coming out of the parser.
+  static uint8_t buf[MAX_FRAME_LEN];
+  size_t bytes = 0;
+  unsigned long responses = HostResponseCount;
+  uint64_t start = NowNs();
+  for (int round = 0; round < m_rounds; round++) {
+    ForgetResponses(&m_port);
+    for (size_t i = 0; i < mix->numFrames; i++) {
+      Packet_t pkt = { .len = mix->frame[i].len, .buf = buf };
+      memcpy(buf, mix->frame[i].buf, pkt.len);
+      PacketReceived(&m_port, &pkt);
+      bytes += pkt.len;
+    }
+  }
+  uint64_t ns = NowNs() - start;
+  Report("packet_received/requests", ns, mix->numFrames * m_rounds, bytes);
+  printf("%-32s %8lu responses\n", "", HostResponseCount - responses);
+}
+
+static void BenchRxPath(const Mix_t *mix) {
+  unsigned long responses = HostResponseCount;
+  uint64_t start = NowNs();
+  for (int round = 0; round < m_rounds; round++) {
+    ForgetResponses(&m_port);
+    FeedStream(&m_port.parser, mix, true);
+  }
+  uint64_t ns = NowNs() - start;
+  Report("rx_path/requests", ns, mix->numFrames * m_rounds,
+         mix->streamLen * m_rounds);
+  printf("%-32s %8lu responses\n", "", HostResponseCount - responses);
+}
+
+// The RX path the way main.c runs it: reads go into the RX buffers from
+// the USBD event handler and the main loop gets to them a round (or all
+// of the buffers) at a time, which is roughly the worst case for the
+// latency.
+static void BenchDeferredRx(const Mix_t *mix) {
+  PacketPort_t *port = &m_port;
+  unsigned long responses = HostResponseCount;
+  PacketRxResetStats(port);
+  uint64_t start = NowNs();
+  for (int round = 0; round < m_rounds; round++) {
+    ForgetResponses(port);
+    for (size_t offset = 0; offset < mix->streamLen; offset += CHUNK_SIZE) {
+      size_t chunkLen = mix->streamLen - offset;
+      if (chunkLen > CHUNK_SIZE) {
+        chunkLen = CHUNK_SIZE;
+      }
+      if (!ReadInto(port, &mix->stream[offset], chunkLen)) {
+        PacketPortProcessRx(port);
+        ReadInto(port, &mix->stream[offset], chunkLen);
+      }
+    }
+    PacketPortProcessRx(port);
+  }
+  uint64_t ns = NowNs() - start;
+  Report("rx_path/deferred", ns, mix->numFrames * m_rounds,
+         mix->streamLen * m_rounds);
+  const PacketRxStats_t *stats = &port->rxStats;
+  printf("%-32s %8lu responses %8.0f ns avg %8lu ns max read to handled %lu starved\n", "",
+         HostResponseCount - responses,
+         stats->handled ? (double)stats->latency / stats->handled : 0.0,
+         (unsigned long)stats->maxLatency, (unsigned long)stats->starved);
+}
+
+// Per command results collected by BenchRoundTrip.
+typedef struct {
+  size_t        numSamples;
+  uint32_t     *ns;
+  unsigned long copies;
+  unsigned long copyBytes;
+  unsigned long allocs;
+  unsigned long responses;
+} Latency_t;
+
+// Host side of the round trip: decodes what the firmware sends back.
+static SLIP_Parser_t m_hostParser;
+static uint8_t m_expectSeqNum;
+static unsigned long m_rcvdResponses;
+static bool m_responseMismatch;
+
+// slip.c is shared by both ends of the link, so the copies made on the
+// host side are tallied here and left out of the per frame figures.
+static unsigned long m_hostCopies;
+static unsigned long m_hostCopyBytes;
+
+static void HostResponseFrame(const Packet_t *packet, void *context) {
+  if (packet->len < 7 || packet->buf[1] != m_expectSeqNum) {
+    m_responseMismatch = true;
+  }
+  m_rcvdResponses++;
+}
+
+static void HostResponse(uint8_t *buf, size_t bufLen) {
+  unsigned long copies = HostCopyCount;
+  unsigned long copyBytes = HostCopyBytes;
+  SLIP_parseChunk(&m_hostParser, buf, bufLen);
+  m_hostCopies += HostCopyCount - copies;
+  m_hostCopyBytes += HostCopyBytes - copyBytes;
+}
+
+static const char *CommandName(uint8_t commandId) {
+  switch (commandId) {
+    case APS_DATA_CONFIRM:      return "aps_data_confirm";
+    case DEVICE_STATE:          return "device_state";
+    case CHANGE_NETWORK_STATE:  return "change_network_state";
+    case READ_PARAMETER:        return "read_parameter";
+    case WRITE_PARAMETER:       return "write_parameter";
+    case VERSION:               return "version";
+    case DEVICE_STATE_CHANGED:  return "device_state_changed";
+    case APS_DATA_REQUEST:      return "aps_data_request";
+    case APS_DATA_INDICATION:   return "aps_data_indication";
+    case READ_PARAMETERS:       return "read_parameters";
+    case FRAGMENT:              return "fragment";
+  }
+  return "unknown";
+}
+
+static int CompareU32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+static void ReportLatency(const char *name, Latency_t *latency) {
+  size_t n = latency->numSamples;
+  if (n == 0) {
+    return;
+  }
+  qsort(latency->ns, n, sizeof(latency->ns[0]), CompareU32);
+  printf("%-32s %8zu frames %7u p50 %7u p99 %7u max ns %5.2f copies %6.1f bytes copied %4.2f allocs %4.2f responses /frame\n",
+         name, n, latency->ns[n / 2], latency->ns[n * 99 / 100], latency->ns[n - 1],
+         (double)latency->copies / n, (double)latency->copyBytes / n,
+         (double)latency->allocs / n, (double)latency->responses / n);
+}
+
+// Pushes each request through the whole path, one frame at a time, the
+// way the tester drives the dongle: SLIP encode on the host, USB sized
+// chunks into the port's parser, PacketReceived, the response encoder
+// and SLIP decode back on the host.
+static void BenchRoundTrip(const Mix_t *mix) {
+  static uint8_t encoded[MAX_FRAME_LEN * 2 + 2];
+  static uint8_t rxBuf[CHUNK_SIZE];
+  static Latency_t latency[256];  // indexed by commandId
+  Latency_t all = { 0 };
+  size_t maxSamples = mix->numFrames * m_rounds;
+  size_t indication = 0;
+
+  all.ns = malloc(maxSamples * sizeof(all.ns[0]));
+  for (size_t i = 0; i < mix->numFrames; i++) {
+    Latency_t *l = &latency[mix->frame[i].buf[0]];
+    if (l->ns == NULL) {
+      l->ns = malloc(maxSamples * sizeof(l->ns[0]));
+    }
+  }
+
+  // Calling the clock costs something too, so take that back off.
+  uint64_t overhead = UINT64_MAX;
+  for (int i = 0; i < 1000; i++) {
+    uint64_t t0 = NowNs();
+    uint64_t t1 = NowNs();
+    if (t1 - t0 < overhead) {
+      overhead = t1 - t0;
+    }
+  }
+
+  PacketResetStats();
+  SLIP_initParser(&m_hostParser, HostResponseFrame, NULL);
+  HostWriteResponse = HostResponse;
+  m_rcvdResponses = 0;
+  m_responseMismatch = false;
+  for (int round = 0; round < m_rounds; round++) {
+    ForgetResponses(&m_port);
+    for (size_t i = 0; i < mix->numFrames; i++) {
+      const Frame_t *frame = &mix->frame[i];
+      Latency_t *l = &latency[frame->buf[0]];
+      if (frame->buf[0] == APS_DATA_INDICATION) {
+        // Give it something to read, as the endpoint handler would.
+        do {
+          indication = (indication + 1) % m_responses.numFrames;
+        } while (m_responses.frame[indication].buf[0] != APS_DATA_INDICATION);
+        QueueIndication(&m_responses.frame[indication]);
+      }
+      unsigned long copies = HostCopyCount;
+      unsigned long copyBytes = HostCopyBytes;
+      unsigned long allocs = HostAllocCount;
+      unsigned long responses = HostResponseCount;
+      m_expectSeqNum = frame->buf[1];
+      m_hostCopies = 0;
+      m_hostCopyBytes = 0;
+
+      uint64_t start = NowNs();
+      Packet_t pkt = { .len = frame->len, .buf = (uint8_t *)frame->buf };
+      size_t encodedLen = SLIP_encapsulate(&pkt, encoded, sizeof(encoded));
+      m_hostCopies += HostCopyCount - copies;
+      m_hostCopyBytes += HostCopyBytes - copyBytes;
+      for (size_t offset = 0; offset < encodedLen; offset += CHUNK_SIZE) {
+        size_t chunkLen = encodedLen - offset;
+        if (chunkLen > CHUNK_SIZE) {
+          chunkLen = CHUNK_SIZE;
+        }
+        memcpy(rxBuf, &encoded[offset], chunkLen);
+        PacketPortReceive(&m_port, rxBuf, chunkLen);
+      }
+      uint64_t ns = NowNs() - start;
+      ns = ns > overhead ? ns - overhead : 0;
+
+      l->ns[l->numSamples++] = ns;
+      all.ns[all.numSamples++] = ns;
+      l->copies += HostCopyCount - copies - m_hostCopies;
+      l->copyBytes += HostCopyBytes - copyBytes - m_hostCopyBytes;
+      l->allocs += HostAllocCount - allocs;
+      l->responses += HostResponseCount - responses;
+    }
+  }
+  HostWriteResponse = NULL;
+
+  for (size_t i = 0; i < ARRAY_LEN(latency); i++) {
+    if (latency[i].numSamples > 0) {
+      char name[64];
+      snprintf(name, sizeof(name), "round_trip/%s", CommandName(i));
+      ReportLatency(name, &latency[i]);
+      all.copies += latency[i].copies;
+      all.copyBytes += latency[i].copyBytes;
+      all.allocs += latency[i].allocs;
+      all.responses += latency[i].responses;
+    }
+    free(latency[i].ns);
+    memset(&latency[i], 0, sizeof(latency[i]));
+  }
+  ReportLatency("round_trip/all", &all);
+  free(all.ns);
+
+  // What the dispatcher in PacketReceived saw (the host build counts
+  // nanoseconds rather than cycles).
+  const PacketStats_t *stats = PacketGetStats();
+  for (unsigned id = 0; id < NUM_COMMAND_IDS; id++) {
+    const PacketCommandStats_t *cmd = &stats->command[id];
+    if (cmd->calls > 0) {
+      printf("dispatch/%-23s %8u calls %7.1f avg %7u max ns\n",
+             PacketCommandName(id), cmd->calls,
+             (double)cmd->cycles / cmd->calls, cmd->maxCycles);
+    }
+  }
+  printf("dispatch/%-23s %8u calls\n", "unknown", stats->unknown);
+  printf("dispatch/%-23s %8u responses\n", "errors", stats->errors);
+
+  if (m_responseMismatch || m_rcvdResponses != all.responses) {
+    fprintf(stderr, "round_trip: %lu responses sent, %lu decoded%s\n",
+            all.responses, m_rcvdResponses,
+            m_responseMismatch ? " with mismatches" : "");
+    exit(1);
+  }
+}
+
+static void Usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-n rounds] [-v]\n", prog);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "n:v")) != -1) {
+    switch (opt) {
+      case 'n':
+        m_rounds = atoi(optarg);
+        break;
+      case 'v':
+        HostLogLevel = NRF_LOG_SEVERITY_DEBUG;
+        break;
+      default:
+        Usage(argv[0]);
+    }
+  }
+  if (m_rounds <= 0) {
+    Usage(argv[0]);
+  }
+
+  // The verifiers provoke errors on purpose, so keep the expected
+  // error logs out of the output.
+  int logLevel = HostLogLevel;
+  if (HostLogLevel < NRF_LOG_SEVERITY_DEBUG) {
+    HostLogLevel = NRF_LOG_SEVERITY_NONE;
+  }
+
+  PacketPortInit(&m_port, HostTxReady, NULL);
+  HostApsRequestReady = RunStack;
+  DeviceStateSetNetwork(DEVICE_STATE_NET_CONNECTED);
+  ParamRefresh();
+  BuildMixes();
+  VerifyPorts(&m_requests);
+  VerifyErrors();
+  VerifyParameters();
+  VerifyReadParameters();
+  VerifyWriteParameter();
+  VerifyResponseCache();
+  VerifyFragments();
+  VerifyDeviceState();
+  VerifyApsIndication(&m_responses);
+  VerifyApsRequest();
+  VerifyTxQueue();
+  VerifyCoalescing(&m_requests);
+  VerifyRxRing(&m_requests);
+  VerifyDecode(&m_requests);
+  VerifyDecode(&m_responses);
+  VerifyNoise();
+  VerifyEncode(&m_requests);
+  VerifyEncode(&m_responses);
+  VerifyEncodev(&m_requests);
+  VerifyEncodev(&m_responses);
+  for (size_t i = 0; i < ARRAY_LEN(m_density); i++) {
+    VerifyDecode(&m_density[i]);
+    VerifyEncode(&m_density[i]);
+  }
+  VerifyLongRun();
+
+  printf("%zu request frames (%zu bytes encoded), %zu response frames (%zu bytes encoded), %d rounds\n",
+         m_requests.numFrames, m_requests.streamLen,
+         m_responses.numFrames, m_responses.streamLen, m_rounds);
+  printf("SLIP byte classifier: %s\n", SLIP_CONFIG_USE_LUT ? "table" : "word compare");
+
+  BenchDecode(&m_requests, false);
+  BenchDecode(&m_responses, false);
+  BenchDecode(&m_requests, true);
+  BenchDecode(&m_responses, true);
+  BenchEncode(&m_requests);
+  BenchEncode(&m_responses);
+  BenchEncodev(&m_requests);
+  BenchEncodev(&m_responses);
+  for (size_t i = 0; i < ARRAY_LEN(m_density); i++) {
+    BenchDecode(&m_density[i], false);
+    BenchDecode(&m_density[i], true);
+    BenchEncode(&m_density[i]);
+  }
+  BenchPacketReceived(&m_requests);
+  BenchRxPath(&m_requests);
+  BenchDeferredRx(&m_requests);
+  BenchRoundTrip(&m_requests);
+
+  HostLogLevel = logLevel;
+  return 0;
+}
@@ -0,0 +1,45 @@
+/**
+ * host_count.h - counts the copies/allocations made by the protocol code
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.*
+ */
+
+#if !defined(HOST_COUNT_H)
+#define HOST_COUNT_H
+
+// The Makefile forces this into the firmware sources (but not the
+// bench itself) so that the bench can report how much copying and
+// allocating goes on per frame.
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern unsigned long HostCopyCount;
+extern unsigned long HostCopyBytes;
+extern unsigned long HostAllocCount;
+
+static inline void *HostCountedMemcpy(void *dst, const void *src, size_t len) {
+  HostCopyCount++;
+  HostCopyBytes += len;
+  return memcpy(dst, src, len);
+}
+
+static inline void *HostCountedMemmove(void *dst, const void *src, size_t len) {
+  HostCopyCount++;
+  HostCopyBytes += len;
+  return memmove(dst, src, len);
+}
+
+static inline void *HostCountedMalloc(size_t size) {
+  HostAllocCount++;
+  return malloc(size);
+}
+
+#define memcpy(dst, src, len)   HostCountedMemcpy(dst, src, len)
+#define memmove(dst, src, len)  HostCountedMemmove(dst, src, len)
+#define malloc(size)            HostCountedMalloc(size)
+
+#endif  // HOST_COUNT_H
@@ -0,0 +1,142 @@
+/**
+ * host_stubs.c - glue for running the protocol code on a host
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.*
+ */
+
+#include "host_stubs.h"
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "aps.h"
+#include "device_state.h"
+#include "nrf_log.h"
+#include "nrf_802154.h"
+#include "packet.h"
+#include "param.h"
+#include "zboss_api.h"
+
+#define DEBUG_FLAG(flag)  bool DEBUG_ ## flag = false;
+#include "debug_flags.h"
+
+int HostLogLevel = NRF_LOG_SEVERITY_WARNING;
+unsigned long HostLogCount[5];
+
+HostWriteResponseHook HostWriteResponse;
+HostDeviceStateChangedHook HostDeviceStateChanged;
+HostApsRequestReadyHook HostApsRequestReady;
+HostParamWrittenHook HostParamWritten;
+unsigned long HostResponseCount;
+unsigned long HostResponseBytes;
+
+unsigned long HostCopyCount;
+unsigned long HostCopyBytes;
+unsigned long HostAllocCount;
+
+// Values match the "Network parameters" dump at the bottom of packet.c
+static const zb_ieee_addr_t m_longAddress = {
+  0xc0, 0x79, 0x02, 0xff, 0xff, 0x2e, 0x21, 0x00
+};
+static const zb_ext_pan_id_t m_extPanId = {
+  0xc0, 0x79, 0x02, 0xff, 0xff, 0x2e, 0x21, 0x00
+};
+static const uint8_t m_networkKey[16] = {
+  0xd0, 0x98, 0x40, 0xd0, 0x6c, 0x00, 0xfc, 0x24,
+  0x98, 0x64, 0x6c, 0x40, 0x48, 0x00, 0x00, 0x00
+};
+
+void HostLog(int severity, const char *fmt, ...) {
+  HostLogCount[severity]++;
+  if (severity > HostLogLevel) {
+    return;
+  }
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fputc('\n', stderr);
+}
+
+void HostLogHexdump(int severity, const void *buf, size_t len) {
+  HostLogCount[severity]++;
+  if (severity > HostLogLevel) {
+    return;
+  }
+  const uint8_t *src = buf;
+  for (size_t i = 0; i < len; i++) {
+    fprintf(stderr, "%s%02x", (i % 16) == 0 ? (i ? "\n " : " ") : " ", src[i]);
+  }
+  fputc('\n', stderr);
+}
+
+void HostTxReady(PacketPort_t *port) {
+  // Behave like an endpoint which is always free: drain the response
+  // a transfer at a time.
+  uint8_t txBuf[PACKET_TX_TRANSFER_SIZE];
+  size_t txLen;
+
+  HostResponseCount++;
+  while ((txLen = PacketTxFill(port, txBuf, sizeof(txBuf))) > 0) {
+    HostResponseBytes += txLen;
+    if (HostWriteResponse) {
+      HostWriteResponse(txBuf, txLen);
+    }
+  }
+}
+
+void DeviceStateChanged(uint8_t deviceState) {
+  if (HostDeviceStateChanged) {
+    HostDeviceStateChanged(deviceState);
+  }
+}
+
+void ApsRequestReady(void) {
+  if (HostApsRequestReady) {
+    HostApsRequestReady();
+  }
+}
+
+void ParamWritten(void) {
+  if (HostParamWritten) {
+    HostParamWritten();
+  }
+}
+
+void ParamRefresh(void) {
+  // What main.c would find in the stack
+  zb_ieee_addr_t addr64;
+  zb_get_long_address(addr64);
+  ParamSet(PARAM_ID_MAC_ADRESS, addr64, sizeof(addr64));
+  ParamSet(PARAM_ID_TRUST_CENTER_ADDR64, addr64, sizeof(addr64));
+  ParamSetU8(PARAM_ID_APS_DESIGNATED_COORDINATOR, 1);
+  zb_get_extended_pan_id(addr64);
+  ParamSet(PARAM_ID_PAN_ID64, addr64, sizeof(addr64));
+  ParamSetU16(PARAM_ID_PAN_ID16, 0x17b3);
+  ParamSetU16(PARAM_ID_NWK_ADDR16, 0x0000);
+  ParamSetU32(PARAM_ID_SCAN_CHANNELS, zb_get_bdb_primary_channel_set());
+  ParamSetU8(PARAM_ID_OPERATING_CHANNEL, nrf_802154_channel_get());
+  ParamSetU8(PARAM_ID_SECURITY_MODE, 3);
+  ParamSetU16(PARAM_ID_PROTOCOL_VERSION, 260);
+  ParamSet(PARAM_ID_NETWORK_KEY, m_networkKey, sizeof(m_networkKey));
+  ParamSetU8(PARAM_ID_NETWORK_UPDATE_ID, 7);
+}
+
+void zb_get_long_address(zb_ieee_addr_t addr) {
+  memcpy(addr, m_longAddress, sizeof(zb_ieee_addr_t));
+}
+
+void zb_get_extended_pan_id(zb_ext_pan_id_t ext_pan_id) {
+  memcpy(ext_pan_id, m_extPanId, sizeof(zb_ext_pan_id_t));
+}
+
+zb_uint32_t zb_get_bdb_primary_channel_set(void) {
+  return 1 << 15;
+}
+
+uint8_t nrf_802154_channel_get(void) {
+  return 15;
+}
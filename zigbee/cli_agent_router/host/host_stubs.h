@@ -0,0 +1,57 @@
+/**
+ * host_stubs.h - glue for running the protocol code on a host
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.*
+ */
+
+#if !defined(HOST_STUBS_H)
+#define HOST_STUBS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "packet_port.h"
+
+typedef void (*HostWriteResponseHook)(uint8_t *buf, size_t bufLen);
+typedef void (*HostDeviceStateChangedHook)(uint8_t deviceState);
+typedef void (*HostApsRequestReadyHook)(void);
+typedef void (*HostParamWrittenHook)(void);
+
+// Messages at or below this severity get printed to stderr. Defaults
+// to NRF_LOG_SEVERITY_WARNING.
+extern int HostLogLevel;
+
+// Number of log calls made at each severity (whether printed or not).
+extern unsigned long HostLogCount[5];
+
+// Called with each USB transfer worth of response data. When NULL,
+// responses are just counted.
+extern HostWriteResponseHook HostWriteResponse;
+
+// PacketTxReadyCallback which behaves like an endpoint which is always
+// free, handing each transfer to HostWriteResponse.
+void HostTxReady(PacketPort_t *port);
+
+// Called (when set) by the DeviceStateChanged stub, which stands in for
+// main.c pushing the state out to its ports.
+extern HostDeviceStateChangedHook HostDeviceStateChanged;
+
+// Called (when set) by the ApsRequestReady stub, which stands in for
+// main.c handing requests to ZBOSS.
+extern HostApsRequestReadyHook HostApsRequestReady;
+
+// Called (when set) by the ParamWritten stub, which stands in for
+// main.c applying written parameters to the stack.
+extern HostParamWrittenHook HostParamWritten;
+
+extern unsigned long HostResponseCount;
+extern unsigned long HostResponseBytes;
+
+// Maintained by host_count.h
+extern unsigned long HostCopyCount;
+extern unsigned long HostCopyBytes;
+extern unsigned long HostAllocCount;
+
+#endif  // HOST_STUBS_H
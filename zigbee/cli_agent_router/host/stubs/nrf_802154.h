@@ -0,0 +1,16 @@
+/**
+ * nrf_802154.h - host stand-in for the 802.15.4 radio driver
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.*
+ */
+
+#if !defined(NRF_802154_H)
+#define NRF_802154_H
+
+#include <stdint.h>
+
+uint8_t nrf_802154_channel_get(void);
+
+#endif  // NRF_802154_H
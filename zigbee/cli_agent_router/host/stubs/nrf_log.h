@@ -0,0 +1,41 @@
+/**
+ * nrf_log.h - host stand-in for the nRF5 SDK logger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.*
+ */
+
+#if !defined(NRF_LOG_H)
+#define NRF_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sdk_config.h"
+
+#define NRF_LOG_SEVERITY_NONE     0
+#define NRF_LOG_SEVERITY_ERROR    1
+#define NRF_LOG_SEVERITY_WARNING  2
+#define NRF_LOG_SEVERITY_INFO     3
+#define NRF_LOG_SEVERITY_DEBUG    4
+
+// Like the deferred logger on the target, the arguments are always
+// evaluated. Whether anything is printed is decided at runtime by
+// host_stubs.c so that benchmarks aren't dominated by stdio.
+void HostLog(int severity, const char *fmt, ...);
+void HostLogHexdump(int severity, const void *buf, size_t len);
+
+#define NRF_LOG_ERROR(...)    HostLog(NRF_LOG_SEVERITY_ERROR, __VA_ARGS__)
+#define NRF_LOG_WARNING(...)  HostLog(NRF_LOG_SEVERITY_WARNING, __VA_ARGS__)
+#define NRF_LOG_INFO(...)     HostLog(NRF_LOG_SEVERITY_INFO, __VA_ARGS__)
+#define NRF_LOG_DEBUG(...)    HostLog(NRF_LOG_SEVERITY_DEBUG, __VA_ARGS__)
+
+#define NRF_LOG_HEXDUMP_ERROR(buf, len)    HostLogHexdump(NRF_LOG_SEVERITY_ERROR, buf, len)
+#define NRF_LOG_HEXDUMP_WARNING(buf, len)  HostLogHexdump(NRF_LOG_SEVERITY_WARNING, buf, len)
+#define NRF_LOG_HEXDUMP_INFO(buf, len)     HostLogHexdump(NRF_LOG_SEVERITY_INFO, buf, len)
+#define NRF_LOG_HEXDUMP_DEBUG(buf, len)    HostLogHexdump(NRF_LOG_SEVERITY_DEBUG, buf, len)
+
+#define NRF_LOG_PROCESS()  false
+
+#endif  // NRF_LOG_H
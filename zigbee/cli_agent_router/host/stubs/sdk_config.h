@@ -0,0 +1,18 @@
+/**
+ * sdk_config.h - host build configuration
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.*
+ */
+
+#if !defined(SDK_CONFIG_H)
+#define SDK_CONFIG_H
+
+#include <stdbool.h>
+
+// Mirrors the subset of ../pca10056/blank/config/sdk_config.h that the
+// protocol sources depend on. Anything not listed here picks up the
+// default from the header that uses it.
+
+#endif  // SDK_CONFIG_H
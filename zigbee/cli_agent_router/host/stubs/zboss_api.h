@@ -0,0 +1,38 @@
+/**
+ * zboss_api.h - host stand-in for the ZBOSS API
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.*
+ */
+
+#if !defined(ZBOSS_API_H)
+#define ZBOSS_API_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef uint8_t   zb_uint8_t;
+typedef int8_t    zb_int8_t;
+typedef uint16_t  zb_uint16_t;
+typedef int16_t   zb_int16_t;
+typedef uint32_t  zb_uint32_t;
+typedef int32_t   zb_int32_t;
+typedef uint8_t   zb_bool_t;
+typedef int32_t   zb_ret_t;
+
+#define ZB_FALSE  0
+#define ZB_TRUE   1
+
+#define RET_OK    0
+
+typedef zb_uint8_t  zb_64bit_addr_t[8];
+typedef zb_64bit_addr_t zb_ieee_addr_t;
+typedef zb_64bit_addr_t zb_ext_pan_id_t;
+
+void zb_get_long_address(zb_ieee_addr_t addr);
+void zb_get_extended_pan_id(zb_ext_pan_id_t ext_pan_id);
+zb_uint32_t zb_get_bdb_primary_channel_set(void);
+
+#endif  // ZBOSS_API_H
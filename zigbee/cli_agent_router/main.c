@@ -51,6 +51,9 @@
 
 #include "zigbee_cli.h"
 
+#include "nordic_common.h"
+#include "app_util_platform.h"
+#include "nrf_802154.h"
 #include "nrf_drv_usbd.h"
 #include "nrf_drv_clock.h"
 #include "boards.h"
@@ -63,15 +66,23 @@
 #include "nrf_log_ctrl.h"
 #include "nrf_log_default_backends.h"
 
+#include "aps.h"
+#include "cycles.h"
+#include "device_state.h"
 #include "dumpmem.h"
+#include "main_loop.h"
 #include "slip.h"
 #include "packet.h"
+#include "packet_port.h"
+#include "param.h"
 
-void user_usb_init(void);
+void user_usb_init(app_usbd_class_inst_t const * p_cli_class);
+void user_usb_reset(void);
 
 // #define IEEE_CHANNEL_MASK           ZB_TRANSCEIVER_ALL_CHANNELS_MASK  /**< Allow all channels from 11-26 */
 #define IEEE_CHANNEL_MASK           (1 << 15)
-#define ERASE_PERSISTENT_CONFIG     ZB_TRUE                 /**< Do not erase NVRAM to save the network parameters after device reboot or power-off. NOTE: If this option is set to ZB_TRUE then do full device erase for all network devices before running other samples. */
+#define ERASE_PERSISTENT_CONFIG     ZB_FALSE                /**< Keep NVRAM at start up, since that's where the parameters a host has written (and the network they form) are stored. A device coming from a build which erased NVRAM at start up needs a full flash erase first, so it doesn't start with whatever an older layout left behind. */
+#define PARAM_COMMIT_DELAY_MS       2000                    /**< How long parameter writes have to stop for before they're stored in NVRAM. */
 #define ZIGBEE_NETWORK_STATE_LED    (BSP_BOARD_LED_2)       /**< LED indicating that light switch successfully joind ZigBee network. */
 #define LED_CDC_ACM_TXRX            (BSP_BOARD_LED_3)
 
@@ -110,32 +121,128 @@ ZB_HA_DECLARE_CONFIGURATION_TOOL_EP(cli_agent_ep,
 /* Declare application's device context (list of registered endpoints) for CLI Agent device. */
 ZB_HA_DECLARE_CONFIGURATION_TOOL_CTX(cli_agent_ctx, cli_agent_ep);
 
-#define CDC_ACM_COMM_INTERFACE  0
-#define CDC_ACM_COMM_EPIN       NRF_DRV_USBD_EPIN2
+// The deCONZ protocol is served on up to two CDC ACM ports (the CLI
+// uses interfaces 2 & 3). Each port has its own packet engine, so a
+// host can (for example) use one for control requests and the other
+// for bulk data without one getting stuck behind the other.
+#define CDC_ACM_0_COMM_INTERFACE  0
+#define CDC_ACM_0_COMM_EPIN       NRF_DRV_USBD_EPIN2
 
-#define CDC_ACM_DATA_INTERFACE  1
-#define CDC_ACM_DATA_EPIN       NRF_DRV_USBD_EPIN1
-#define CDC_ACM_DATA_EPOUT      NRF_DRV_USBD_EPOUT1
+#define CDC_ACM_0_DATA_INTERFACE  1
+#define CDC_ACM_0_DATA_EPIN       NRF_DRV_USBD_EPIN1
+#define CDC_ACM_0_DATA_EPOUT      NRF_DRV_USBD_EPOUT1
+
+#define CDC_ACM_1_COMM_INTERFACE  4
+#define CDC_ACM_1_COMM_EPIN       NRF_DRV_USBD_EPIN6
+
+#define CDC_ACM_1_DATA_INTERFACE  5
+#define CDC_ACM_1_DATA_EPIN       NRF_DRV_USBD_EPIN5
+#define CDC_ACM_1_DATA_EPOUT      NRF_DRV_USBD_EPOUT3
+
+#if !defined(NUM_CDC_ACM_PORTS)
+#define NUM_CDC_ACM_PORTS         2
+#endif
 
 static void cdc_acm_user_ev_handler(app_usbd_class_inst_t const * p_inst,
                                     app_usbd_cdc_acm_user_event_t event);
 
-APP_USBD_CDC_ACM_GLOBAL_DEF(m_app_cdc_acm,
+APP_USBD_CDC_ACM_GLOBAL_DEF(m_app_cdc_acm_0,
                             cdc_acm_user_ev_handler,
-                            CDC_ACM_COMM_INTERFACE,
-                            CDC_ACM_DATA_INTERFACE,
-                            CDC_ACM_COMM_EPIN,
-                            CDC_ACM_DATA_EPIN,
-                            CDC_ACM_DATA_EPOUT,
+                            CDC_ACM_0_COMM_INTERFACE,
+                            CDC_ACM_0_DATA_INTERFACE,
+                            CDC_ACM_0_COMM_EPIN,
+                            CDC_ACM_0_DATA_EPIN,
+                            CDC_ACM_0_DATA_EPOUT,
                             APP_USBD_CDC_COMM_PROTOCOL_AT_V250
 );
 
-#define READ_SIZE 64
+#if NUM_CDC_ACM_PORTS > 1
+APP_USBD_CDC_ACM_GLOBAL_DEF(m_app_cdc_acm_1,
+                            cdc_acm_user_ev_handler,
+                            CDC_ACM_1_COMM_INTERFACE,
+                            CDC_ACM_1_DATA_INTERFACE,
+                            CDC_ACM_1_COMM_EPIN,
+                            CDC_ACM_1_DATA_EPIN,
+                            CDC_ACM_1_DATA_EPOUT,
+                            APP_USBD_CDC_COMM_PROTOCOL_AT_V250
+);
+#endif
 
-static uint8_t m_rx_buffer[READ_SIZE];
-// static uint8_t m_tx_buffer[NRF_DRV_USBD_EPSIZE];
-// static bool m_send_flag = 0;
-static SLIP_Parser_t  m_slipParser;
+typedef struct
+{
+    app_usbd_cdc_acm_t const * p_cdc_acm;
+    uint8_t                    comm_interface;
+    PacketPort_t               port;
+    uint8_t                    tx_buffer[PACKET_TX_TRANSFER_SIZE];
+    bool                       tx_busy;
+    volatile bool              tx_flush;    // the queue is to be thrown away
+    volatile bool              open;        // the host has opened the port
+} cdc_acm_port_t;
+
+static cdc_acm_port_t m_cdc_acm_ports[] =
+{
+    { .p_cdc_acm = &m_app_cdc_acm_0, .comm_interface = CDC_ACM_0_COMM_INTERFACE },
+#if NUM_CDC_ACM_PORTS > 1
+    { .p_cdc_acm = &m_app_cdc_acm_1, .comm_interface = CDC_ACM_1_COMM_INTERFACE },
+#endif
+};
+
+static void start_tx(cdc_acm_port_t * p_port);
+
+// Set by the USBD event handler when there's received data to handle or
+// a transfer has finished, and cleared by the main loop.
+static volatile bool m_usb_work;
+
+/**@brief Arms the next read into a free buffer of the port's RX ring.
+ *
+ * Reads the library can satisfy from data it already has finish straight
+ * away, so keep going until one is left pending. If the ring fills up
+ * the endpoint NAKs until usb_process has made room and called this
+ * again. Called in USBD event context, or with it held off.
+ */
+static void rx_arm(cdc_acm_port_t * p_port)
+{
+    uint8_t * p_buf;
+    while ((p_buf = PacketPortRxBuffer(&p_port->port)) != NULL)
+    {
+        ret_code_t ret = app_usbd_cdc_acm_read_any(p_port->p_cdc_acm,
+                                                   p_buf,
+                                                   PACKET_RX_BUFFER_SIZE);
+        if (ret != NRF_SUCCESS)
+        {
+            // NRF_ERROR_IO_PENDING: RX_DONE comes once it has been filled.
+            break;
+        }
+        PacketPortRxDone(&p_port->port, app_usbd_cdc_acm_rx_size(p_port->p_cdc_acm));
+        m_usb_work = true;
+    }
+}
+
+/**@brief Gives up on the port's transfer, if any, and has the main loop
+ *        throw away what's queued.
+ *
+ * Used when the host has gone away. A transfer which was under way then
+ * never raises TX_DONE, so tx_busy has to be cleared here or the port
+ * would never send anything again. Called in USBD event context.
+ */
+static void tx_reset(cdc_acm_port_t * p_port)
+{
+    p_port->tx_busy = false;
+    p_port->tx_flush = true;
+    m_usb_work = true;
+}
+
+static cdc_acm_port_t * cdc_acm_port_get(app_usbd_cdc_acm_t const * p_cdc_acm)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(m_cdc_acm_ports); i++)
+    {
+        if (m_cdc_acm_ports[i].p_cdc_acm == p_cdc_acm)
+        {
+            return &m_cdc_acm_ports[i];
+        }
+    }
+    return NULL;
+}
 
 /**
  * @brief User event handler @ref app_usbd_cdc_acm_user_ev_handler_t (headphones)
@@ -145,6 +252,12 @@ static void cdc_acm_user_ev_handler(app_usbd_class_inst_t const * p_inst,
 {
     // p_cdc_acm points to m_app_cdc_acm_0 or m_app_cdc_acm_1
     app_usbd_cdc_acm_t const * p_cdc_acm = app_usbd_cdc_acm_class_get(p_inst);
+    cdc_acm_port_t * p_port = cdc_acm_port_get(p_cdc_acm);
+
+    if (p_port == NULL)
+    {
+        return;
+    }
 
     switch (event)
     {
@@ -153,54 +266,482 @@ static void cdc_acm_user_ev_handler(app_usbd_class_inst_t const * p_inst,
 #if defined(LED_CDC_ACM_OPEN)
             bsp_board_led_on(LED_CDC_ACM_OPEN);
 #endif
+            p_port->open = true;
 
             /*Setup first transfer*/
-            memset(m_rx_buffer, 0xee, sizeof(m_rx_buffer));
-            ret_code_t ret = app_usbd_cdc_acm_read_any(p_cdc_acm,
-                                                       m_rx_buffer,
-                                                       READ_SIZE);
-            UNUSED_VARIABLE(ret);
+            rx_arm(p_port);
             break;
         }
-#if defined(LED_CDC_ACM_OPEN)
         case APP_USBD_CDC_ACM_USER_EVT_PORT_CLOSE:
+#if defined(LED_CDC_ACM_OPEN)
             bsp_board_led_off(LED_CDC_ACM_OPEN);
-            break;
 #endif
+            p_port->open = false;
+            tx_reset(p_port);
+            break;
         case APP_USBD_CDC_ACM_USER_EVT_TX_DONE:
+            // The next transfer gets started from the main loop.
+            p_port->tx_busy = false;
+            m_usb_work = true;
             bsp_board_led_invert(LED_CDC_ACM_TXRX);
             break;
         case APP_USBD_CDC_ACM_USER_EVT_RX_DONE:
-        {
-            ret_code_t ret;
-            do
-            {
-                /*Get amount of data transfered*/
-                size_t bytesAvail = app_usbd_cdc_acm_rx_size(p_cdc_acm);
-                SLIP_parseChunk(&m_slipParser, m_rx_buffer, bytesAvail);
-
-                /* Fetch data until internal buffer is empty */
-                ret = app_usbd_cdc_acm_read_any(p_cdc_acm,
-                                                m_rx_buffer,
-                                                READ_SIZE);
-            } while (ret == NRF_SUCCESS);
-
+            /*Get amount of data transfered*/
+            PacketPortRxDone(&p_port->port, app_usbd_cdc_acm_rx_size(p_cdc_acm));
+            m_usb_work = true;
+            // The next read goes into another buffer, so it can be armed
+            // before the main loop gets round to parsing this one.
+            rx_arm(p_port);
             bsp_board_led_invert(LED_CDC_ACM_TXRX);
             break;
-        }
         default:
             break;
     }
 }
 
-void WriteResponse(uint8_t *buf, size_t bufLen) {
-  ret_code_t ret = app_usbd_cdc_acm_write(&m_app_cdc_acm, buf, bufLen);
+size_t NumPacketPorts(void) {
+  return ARRAY_SIZE(m_cdc_acm_ports);
+}
+
+PacketPort_t *GetPacketPort(size_t idx) {
+  return &m_cdc_acm_ports[idx].port;
+}
+
+// Sends as many of the queued responses as fit in one transfer, if the
+// previous transfer has gone out. Called from the main loop, which is where
+// responses get generated. tx_busy is only cleared by the USBD event
+// handler, either on TX_DONE or when the transfer has been given up on
+// (see tx_reset), so once it's seen clear tx_buffer is free to be refilled.
+static void start_tx(cdc_acm_port_t * p_port) {
+  if (p_port->tx_busy) {
+    return;
+  }
+  size_t txLen = PacketTxFill(&p_port->port, p_port->tx_buffer, sizeof(p_port->tx_buffer));
+  if (txLen == 0) {
+    return;
+  }
+  ret_code_t ret;
+  // Keep the USBD event handler from seeing the library half way through
+  // setting up the transfer (or the TX_DONE before tx_busy is set).
+  CRITICAL_REGION_ENTER();
+  ret = app_usbd_cdc_acm_write(p_port->p_cdc_acm, p_port->tx_buffer, txLen);
+  if (ret == NRF_SUCCESS)
+  {
+    p_port->tx_busy = true;
+  }
+  CRITICAL_REGION_EXIT();
   if (ret != NRF_SUCCESS)
   {
-    NRF_LOG_ERROR("Failed to write %lu byte response", bufLen);
+    NRF_LOG_ERROR("Failed to write %lu byte response", txLen);
+    PacketTxAbort(&p_port->port);
+  }
+}
+
+static void response_ready(PacketPort_t *port) {
+  start_tx(port->context);
+}
+
+void DeviceStateChanged(uint8_t deviceState) {
+  // Called from the ZBOSS main loop, which is also where requests are
+  // handled, so nothing else can be queueing on the ports.
+  //
+  // Ports nobody has opened would only fail the write, so they're left
+  // out. A host reads DEVICE_STATE when it opens the port anyway.
+  for (size_t i = 0; i < ARRAY_SIZE(m_cdc_acm_ports); i++) {
+    if (m_cdc_acm_ports[i].open) {
+      PacketSendDeviceStateChanged(&m_cdc_acm_ports[i].port, deviceState);
+    }
   }
 }
 
+/**@brief Parses and handles whatever the USBD event handler has queued,
+ *        and starts sending the responses.
+ */
+static void usb_process(void)
+{
+    m_usb_work = false;
+    for (size_t i = 0; i < ARRAY_SIZE(m_cdc_acm_ports); i++)
+    {
+        cdc_acm_port_t * p_port = &m_cdc_acm_ports[i];
+
+        if (p_port->tx_flush)
+        {
+            p_port->tx_flush = false;
+            PacketTxFlush(&p_port->port);
+        }
+        UNUSED_RETURN_VALUE(PacketPortProcessRx(&p_port->port));
+        if (p_port->port.rxStarved)
+        {
+            CRITICAL_REGION_ENTER();
+            rx_arm(p_port);
+            CRITICAL_REGION_EXIT();
+        }
+        start_tx(p_port);
+    }
+}
+
+/**@brief Puts the ZCL header back in front of the payload.
+ *
+ * ZBOSS has already parsed and cut the header off by the time the
+ * endpoint handler sees the frame, but the deCONZ host wants the whole
+ * ASDU.
+ */
+static size_t zcl_header_build(zb_zcl_parsed_hdr_t const * p_cmd_info, uint8_t * p_buf)
+{
+    uint8_t * p = p_buf;
+
+    *p++ = (p_cmd_info->is_common_command ? 0x00 : 0x01) |
+           (p_cmd_info->is_manuf_specific ? 0x04 : 0x00) |
+           (p_cmd_info->cmd_direction ? 0x08 : 0x00) |
+           (p_cmd_info->disable_default_response ? 0x10 : 0x00);
+    if (p_cmd_info->is_manuf_specific)
+    {
+        *p++ = p_cmd_info->manuf_specific & 0xff;
+        *p++ = p_cmd_info->manuf_specific >> 8;
+    }
+    *p++ = p_cmd_info->seq_number;
+    *p++ = p_cmd_info->cmd_id;
+    return p - p_buf;
+}
+
+/**@brief Endpoint handler which queues a copy of each received frame for
+ *        the deCONZ hosts before handing it on to the CLI.
+ *
+ * @param[in]   param   Reference to the ZigBee stack buffer holding the frame.
+ */
+static zb_uint8_t deconz_ep_handler(zb_uint8_t param)
+{
+    zb_buf_t            * p_zcl_cmd_buf = (zb_buf_t *)ZB_BUF_FROM_REF(param);
+    zb_zcl_parsed_hdr_t * p_cmd_info    = ZB_GET_BUF_PARAM(p_zcl_cmd_buf, zb_zcl_parsed_hdr_t);
+    zb_zcl_addr_t const * p_source      = &ZB_ZCL_PARSED_HDR_SHORT_DATA(p_cmd_info).source;
+    uint8_t               zcl_hdr[5];
+    size_t                zcl_hdr_len   = zcl_header_build(p_cmd_info, zcl_hdr);
+    size_t                payload_len   = ZB_BUF_LEN(p_zcl_cmd_buf);
+
+    if (zcl_hdr_len + payload_len > APS_INDICATION_MAX_ASDU)
+    {
+        ApsIndicationOversize();
+        NRF_LOG_WARNING("APS indication too big (%u bytes)", zcl_hdr_len + payload_len);
+        return cli_agent_ep_handler(param);
+    }
+
+    ApsIndication_t * p_ind = ApsIndicationAlloc();
+    if (p_ind == NULL)
+    {
+        return cli_agent_ep_handler(param);
+    }
+
+    p_ind->dstAddrMode = APS_ADDR_MODE_NWK;
+    p_ind->dstAddr16   = ZB_ZCL_PARSED_HDR_SHORT_DATA(p_cmd_info).dst_addr;
+    p_ind->dstEndpoint = ZB_ZCL_PARSED_HDR_SHORT_DATA(p_cmd_info).dst_endpoint;
+    p_ind->srcEndpoint = ZB_ZCL_PARSED_HDR_SHORT_DATA(p_cmd_info).src_endpoint;
+    p_ind->profileId   = p_cmd_info->profile_id;
+    p_ind->clusterId   = p_cmd_info->cluster_id;
+    p_ind->lqi         = 0;   // unknown
+    p_ind->rssi        = 0;
+    if (p_source->addr_type == ZB_ZCL_ADDR_TYPE_IEEE)
+    {
+        p_ind->srcAddrMode = APS_ADDR_MODE_IEEE;
+        memcpy(p_ind->srcAddr64, p_source->u.ieee_addr, sizeof(p_ind->srcAddr64));
+    }
+    else
+    {
+        p_ind->srcAddrMode = APS_ADDR_MODE_NWK;
+        p_ind->srcAddr16   = p_source->u.short_addr;
+        // Link quality comes from the neighbor table entry of the sender.
+        zb_zdo_get_diag_data(p_ind->srcAddr16, &p_ind->lqi, &p_ind->rssi);
+    }
+    memcpy(p_ind->asdu, zcl_hdr, zcl_hdr_len);
+    memcpy(&p_ind->asdu[zcl_hdr_len], ZB_BUF_BEGIN(p_zcl_cmd_buf), payload_len);
+    p_ind->asduLen = zcl_hdr_len + payload_len;
+    ApsIndicationCommit();
+
+    // The CLI still gets to see (and may consume) the frame.
+    return cli_agent_ep_handler(param);
+}
+
+// One ZBOSS buffer per APS_DATA_REQUEST slot, reserved at startup so
+// that accepting a request never depends on the stack having a buffer
+// to spare. ZBOSS hands each one back with its confirm.
+static zb_uint8_t m_aps_request_bufs[APS_REQUEST_QUEUE_SIZE];
+
+static volatile bool m_aps_request_ready;
+
+void ApsRequestReady(void)
+{
+    // Called while handling a host's request; aps_requests_send does the
+    // sending.
+    m_aps_request_ready = true;
+}
+
+static void aps_request_pool_init(void)
+{
+    for (size_t i = 0; i < APS_REQUEST_QUEUE_SIZE; i++)
+    {
+        zb_buf_t * p_buf = ZB_GET_OUT_BUF();
+        ZB_ERROR_CHECK(p_buf == NULL ? RET_NO_MEMORY : RET_OK);
+        m_aps_request_bufs[i] = ZB_REF_FROM_BUF(p_buf);
+    }
+}
+
+/**@brief Called by ZBOSS once an APS_DATA_REQUEST has been sent (or has failed).
+ *
+ * @param[in]   param   Reference to the request's buffer.
+ */
+static void aps_data_confirm_cb(zb_uint8_t param)
+{
+    zb_buf_t                     * p_buf    = ZB_BUF_FROM_REF(param);
+    zb_zcl_command_send_status_t * p_status = ZB_GET_BUF_PARAM(p_buf, zb_zcl_command_send_status_t);
+
+    for (size_t i = 0; i < APS_REQUEST_QUEUE_SIZE; i++)
+    {
+        if (m_aps_request_bufs[i] == param)
+        {
+            // The buffer stays with the slot for the next request.
+            ApsRequestConfirm(ApsRequestGet(i),
+                              p_status->status == RET_OK ? APS_STATUS_SUCCESS : APS_STATUS_NO_ACK);
+            return;
+        }
+    }
+    NRF_LOG_ERROR("APS confirm for unknown buffer %u", param);
+    ZB_FREE_BUF_BY_REF(param);
+}
+
+/**@brief Hands the requests accepted from the hosts to ZBOSS.
+ *
+ * zb_zcl_finish_and_send_packet only schedules the send, so this never
+ * waits on the radio. The request's txOptions and radius aren't used;
+ * ZBOSS applies its defaults.
+ */
+static void aps_requests_send(void)
+{
+    ApsRequest_t * p_req;
+
+    m_aps_request_ready = false;
+    while ((p_req = ApsRequestNextPending()) != NULL)
+    {
+        zb_buf_t   * p_buf = ZB_BUF_FROM_REF(m_aps_request_bufs[ApsRequestIndex(p_req)]);
+        zb_uint8_t * p_data;
+        zb_addr_u    dst_addr;
+        zb_uint8_t   dst_addr_mode;
+
+        switch (p_req->dstAddrMode)
+        {
+            case APS_ADDR_MODE_GROUP:
+                dst_addr.addr_short = p_req->dstAddr16;
+                dst_addr_mode = ZB_APS_ADDR_MODE_16_GROUP_ENDP_NOT_PRESENT;
+                break;
+            case APS_ADDR_MODE_IEEE:
+                ZB_IEEE_ADDR_COPY(dst_addr.addr_long, p_req->dstAddr64);
+                dst_addr_mode = ZB_APS_ADDR_MODE_64_ENDP_PRESENT;
+                break;
+            default:
+                dst_addr.addr_short = p_req->dstAddr16;
+                dst_addr_mode = ZB_APS_ADDR_MODE_16_ENDP_PRESENT;
+                break;
+        }
+
+        ZB_BUF_REUSE(p_buf);
+        ZB_BUF_INITIAL_ALLOC(p_buf, p_req->asduLen, p_data);
+        memcpy(p_data, p_req->asdu, p_req->asduLen);
+        zb_zcl_finish_and_send_packet(p_buf, p_data + p_req->asduLen, &dst_addr, dst_addr_mode,
+                                      p_req->dstEndpoint, p_req->srcEndpoint,
+                                      p_req->profileId, p_req->clusterId,
+                                      aps_data_confirm_cb);
+    }
+}
+
+// deCONZ protocol version reported by READ_PARAMETER
+#define DECONZ_PROTOCOL_VERSION     0x0104
+
+// Security mode 3: no master key, but a trust center link key
+#define DECONZ_SECURITY_MODE        3
+
+void ParamRefresh(void) {
+  zb_ieee_addr_t addr64;
+  bool coordinator = zb_get_network_role() == ZB_NWK_DEVICE_TYPE_COORDINATOR;
+
+  zb_get_long_address(addr64);
+  ParamSet(PARAM_ID_MAC_ADRESS, addr64, sizeof(addr64));
+  // This device forms the network, so it's the trust center as well.
+  if (!coordinator) {
+    memset(addr64, 0, sizeof(addr64));
+  }
+  ParamSet(PARAM_ID_TRUST_CENTER_ADDR64, addr64, sizeof(addr64));
+  ParamSetU8(PARAM_ID_APS_DESIGNATED_COORDINATOR, coordinator);
+
+  zb_get_extended_pan_id(addr64);
+  ParamSet(PARAM_ID_PAN_ID64, addr64, sizeof(addr64));
+  ParamSetU16(PARAM_ID_PAN_ID16, ZB_PIBCACHE_PAN_ID());
+  ParamSetU16(PARAM_ID_NWK_ADDR16, ZB_PIBCACHE_NETWORK_ADDRESS());
+  ParamSetU32(PARAM_ID_SCAN_CHANNELS, zb_get_bdb_primary_channel_set());
+  ParamSetU8(PARAM_ID_OPERATING_CHANNEL, nrf_802154_channel_get());
+  ParamSetU8(PARAM_ID_SECURITY_MODE, DECONZ_SECURITY_MODE);
+  ParamSetU16(PARAM_ID_PROTOCOL_VERSION, DECONZ_PROTOCOL_VERSION);
+
+  // The APS PAN ID64 is left at 0 (use the network's). ZBOSS has no
+  // public getters for the network key, update ID or remaining permit
+  // join time, so the key and permit join time keep whatever was last
+  // written (the key is restored from NVRAM by param_nvram_read), and
+  // the update ID stays at 0. It has no setter either, so it's read
+  // only.
+}
+
+// Parameters written by a host are stored as the application's NVRAM
+// dataset, so that they survive a reset without a rebuild.
+typedef struct
+{
+    uint32_t        channel_mask;
+    zb_ext_pan_id_t ext_pan_id;
+    uint8_t         nwk_key[16];
+    uint8_t         unused;         // was the network update ID
+    uint8_t         written;        // PARAM_NVRAM_xxx for the fields a host has written
+    uint8_t         reserved[2];    // keeps the size a multiple of 4
+} param_nvram_t;
+
+#define PARAM_NVRAM_CHANNEL_MASK    0x01
+#define PARAM_NVRAM_EXT_PAN_ID      0x02
+#define PARAM_NVRAM_NWK_KEY         0x04
+
+static param_nvram_t     m_param_nvram;
+static volatile bool     m_param_written;
+
+void ParamWritten(void)
+{
+    // Called while handling a host's request; params_apply applies them.
+    m_param_written = true;
+}
+
+// Fields which were never written keep the values the stack started
+// with.
+static void param_apply_nvram(void)
+{
+    if (m_param_nvram.written & PARAM_NVRAM_CHANNEL_MASK)
+    {
+        zb_set_bdb_primary_channel_set(m_param_nvram.channel_mask);
+    }
+    if (m_param_nvram.written & PARAM_NVRAM_EXT_PAN_ID)
+    {
+        zb_set_extended_pan_id(m_param_nvram.ext_pan_id);
+    }
+    if (m_param_nvram.written & PARAM_NVRAM_NWK_KEY)
+    {
+        zb_secur_setup_nwk_key(m_param_nvram.nwk_key, 0);
+        ParamSet(PARAM_ID_NETWORK_KEY, m_param_nvram.nwk_key, sizeof(m_param_nvram.nwk_key));
+    }
+    ParamRefresh();
+}
+
+static void param_nvram_read(zb_uint8_t page, zb_uint32_t pos, zb_uint16_t payload_length)
+{
+    if (payload_length != sizeof(m_param_nvram))
+    {
+        NRF_LOG_WARNING("Ignoring %u bytes of stored parameters", payload_length);
+        return;
+    }
+    zb_ret_t ret = zb_osif_nvram_read(page, pos, (zb_uint8_t *)&m_param_nvram, sizeof(m_param_nvram));
+    if (ret == RET_OK)
+    {
+        param_apply_nvram();
+    }
+}
+
+static zb_ret_t param_nvram_write(zb_uint8_t page, zb_uint32_t pos)
+{
+    return zb_osif_nvram_write(page, pos, (zb_uint8_t *)&m_param_nvram, sizeof(m_param_nvram));
+}
+
+static zb_uint16_t param_nvram_size(void)
+{
+    return sizeof(m_param_nvram);
+}
+
+static void param_commit(zb_uint8_t param)
+{
+    UNUSED_PARAMETER(param);
+    if (zb_nvram_write_dataset(ZB_NVRAM_APP_DATA1) == RET_OK)
+    {
+        ParamGetStats()->commits++;
+    }
+    else
+    {
+        NRF_LOG_ERROR("Storing parameters failed");
+    }
+}
+
+static void permit_join_send(zb_uint8_t param)
+{
+    zb_zdo_mgmt_permit_joining_req_param_t * p_req =
+        ZB_GET_BUF_PARAM(ZB_BUF_FROM_REF(param), zb_zdo_mgmt_permit_joining_req_param_t);
+    size_t len;
+
+    ZB_BZERO(p_req, sizeof(*p_req));
+    p_req->dest_addr       = 0xfffc;    // all routers, which includes this device
+    p_req->permit_duration = *ParamGet(PARAM_ID_PERMIT_JOIN, &len);
+    p_req->tc_significance = 1;
+    UNUSED_RETURN_VALUE(zb_zdo_mgmt_permit_joining_req(param, NULL));
+}
+
+// Applies the parameters written by a host to the running stack. Each
+// write which changes a stored value pushes the NVRAM commit back, so
+// a host writing a whole configuration causes one flash write once
+// it's done, rather than one per parameter.
+static void params_apply(void)
+{
+    uint8_t written = m_param_nvram.written;
+    bool    changed = false;
+    uint8_t param_id;
+    size_t  len;
+
+    m_param_written = false;
+    while (ParamTakeWritten(&param_id))
+    {
+        const uint8_t * p_value = ParamGet(param_id, &len);
+
+        switch (param_id)
+        {
+            case PARAM_ID_PAN_ID64:
+                changed |= memcmp(m_param_nvram.ext_pan_id, p_value, len) != 0;
+                memcpy(m_param_nvram.ext_pan_id, p_value, len);
+                written |= PARAM_NVRAM_EXT_PAN_ID;
+                zb_set_extended_pan_id(m_param_nvram.ext_pan_id);
+                break;
+
+            case PARAM_ID_SCAN_CHANNELS:
+            {
+                uint32_t mask = p_value[0] | (p_value[1] << 8) | (p_value[2] << 16) | ((uint32_t)p_value[3] << 24);
+                changed |= m_param_nvram.channel_mask != mask;
+                m_param_nvram.channel_mask = mask;
+                written |= PARAM_NVRAM_CHANNEL_MASK;
+                zb_set_bdb_primary_channel_set(mask);
+                break;
+            }
+
+            case PARAM_ID_NETWORK_KEY:
+                changed |= memcmp(m_param_nvram.nwk_key, p_value, len) != 0;
+                memcpy(m_param_nvram.nwk_key, p_value, len);
+                written |= PARAM_NVRAM_NWK_KEY;
+                zb_secur_setup_nwk_key(m_param_nvram.nwk_key, 0);
+                break;
+
+            case PARAM_ID_PERMIT_JOIN:
+                // Not stored, since it counts down.
+                UNUSED_RETURN_VALUE(ZB_GET_OUT_BUF_DELAYED(permit_join_send));
+                break;
+        }
+    }
+
+    changed |= written != m_param_nvram.written;
+    m_param_nvram.written = written;
+
+    if (changed)
+    {
+        ZB_SCHEDULE_ALARM_CANCEL(param_commit, ZB_ALARM_ANY_PARAM);
+        UNUSED_RETURN_VALUE(ZB_SCHEDULE_ALARM(param_commit, 0,
+                                              ZB_MILLISECONDS_TO_BEACON_INTERVAL(PARAM_COMMIT_DELAY_MS)));
+    }
+}
+
 static void log_init(void)
 {
     ret_code_t err_code = NRF_LOG_INIT(NULL);
@@ -229,6 +770,8 @@ void zboss_signal_handler(zb_uint8_t param)
             {
                 NRF_LOG_INFO("Device started OK. Start network steering. Reason: %d", sig);
                 bsp_board_led_on(ZIGBEE_NETWORK_STATE_LED);
+                DeviceStateSetNetwork(DEVICE_STATE_NET_CONNECTED);
+                ParamRefresh();
                 UNUSED_RETURN_VALUE(bdb_start_top_level_commissioning(ZB_BDB_NETWORK_STEERING));
             }
             else
@@ -236,6 +779,7 @@ void zboss_signal_handler(zb_uint8_t param)
                 role = zb_get_network_role();
                 NRF_LOG_ERROR("Device startup failed. Status: %d. Retry network formation after 1 second.", status);
                 bsp_board_led_off(ZIGBEE_NETWORK_STATE_LED);
+                DeviceStateSetNetwork(DEVICE_STATE_NET_JOINING);
                 zb_uint8_t mode = (ZB_BDB_NETWORK_STEERING) |
                                   ((role == ZB_NWK_DEVICE_TYPE_COORDINATOR) ? ZB_BDB_NETWORK_FORMATION : 0);
                 UNUSED_RETURN_VALUE(
@@ -252,6 +796,8 @@ void zboss_signal_handler(zb_uint8_t param)
             if (status == RET_OK)
             {
                 bsp_board_led_off(ZIGBEE_NETWORK_STATE_LED);
+                DeviceStateSetNetwork(DEVICE_STATE_NET_OFFLINE);
+                ParamRefresh();
                 p_leave_params = ZB_ZDO_SIGNAL_GET_PARAMS(p_sg_p, zb_zdo_signal_leave_params_t);
                 NRF_LOG_INFO("Network left. Leave type: %d", p_leave_params->leave_type);
             }
@@ -283,10 +829,21 @@ void zboss_signal_handler(zb_uint8_t param)
 
         case ZB_BDB_SIGNAL_STEERING:
             NRF_LOG_INFO("ZB_BDB_SIGNAL_STEERING, status = %d", status);
+            if (status == RET_OK)
+            {
+                DeviceStateSetNetwork(DEVICE_STATE_NET_CONNECTED);
+                ParamRefresh();
+                // Steering opens the network for the BDB minimum commissioning time.
+                ParamSetU8(PARAM_ID_PERMIT_JOIN, ZB_BDBC_MIN_COMMISSIONING_TIME_S);
+            }
             break;
 
         case ZB_BDB_SIGNAL_FORMATION:
             NRF_LOG_INFO("ZB_BDB_SIGNAL_FORMATION, status = %d", status);
+            if (status == RET_OK)
+            {
+                ParamRefresh();
+            }
             break;
 
         case ZB_ZDO_SIGNAL_LEAVE_INDICATION:
@@ -331,13 +888,134 @@ static void fix_logging_level(void) {
     }
 }
 
-void user_usb_init(void) {
+// Called by zigbee_cli.c when the USB device has been stopped, reset or
+// unplugged. Any transfers under way are lost, and the ports stay closed
+// until the host opens them again.
+void user_usb_reset(void) {
+  for (size_t i = 0; i < ARRAY_SIZE(m_cdc_acm_ports); i++) {
+    m_cdc_acm_ports[i].open = false;
+    tx_reset(&m_cdc_acm_ports[i]);
+  }
+}
+
+// Called by zigbee_cli.c to append the USB classes. Interfaces get
+// enumerated in the order the classes are appended, and some hosts
+// (Windows in particular) bind them badly if they're out of order, so
+// the CLI's class goes in between the ports (see CDC_ACM_1_COMM_INTERFACE).
+void user_usb_init(app_usbd_class_inst_t const * p_cli_class) {
   NRF_LOG_INFO("user_usb_init");
-  app_usbd_class_inst_t const * class_cdc_acm = app_usbd_cdc_acm_class_inst_get(&m_app_cdc_acm);
-  ret_code_t ret = app_usbd_class_append(class_cdc_acm);
-  APP_ERROR_CHECK(ret);
+  bool cli_appended = false;
+  ret_code_t ret;
+  for (size_t i = 0; i < ARRAY_SIZE(m_cdc_acm_ports); i++) {
+    if (!cli_appended && m_cdc_acm_ports[i].comm_interface > NRF_CLI_CDC_ACM_COMM_INTERFACE) {
+      ret = app_usbd_class_append(p_cli_class);
+      APP_ERROR_CHECK(ret);
+      cli_appended = true;
+    }
+    app_usbd_class_inst_t const * class_cdc_acm =
+      app_usbd_cdc_acm_class_inst_get(m_cdc_acm_ports[i].p_cdc_acm);
+    ret = app_usbd_class_append(class_cdc_acm);
+    APP_ERROR_CHECK(ret);
+  }
+  if (!cli_appended) {
+    ret = app_usbd_class_append(p_cli_class);
+    APP_ERROR_CHECK(ret);
+  }
+}
+
+static MainLoopStats_t m_main_loop_stats;
+static uint32_t        m_main_loop_ticks;   // RTC count when the CPU last went to sleep or woke up
+
+MainLoopStats_t * MainLoopGetStats(void)
+{
+    return &m_main_loop_stats;
+}
+
+void MainLoopResetStats(void)
+{
+    memset(&m_main_loop_stats, 0, sizeof(m_main_loop_stats));
+    m_main_loop_ticks = app_timer_cnt_get();
+}
+
+#if MAIN_LOOP_SLEEP_ENABLED
+
+static volatile bool m_zboss_idle;
+static bool          m_wake_unexplained;
+
+/**@brief Called by ZBOSS when its scheduler has nothing left to run.
+ *
+ * This replaces the weak version in the ZBOSS platform layer, which
+ * sleeps right away. Sleeping is left to main_loop_sleep instead, so that
+ * the USB ports, the log and the CLI are seen to first and the reason
+ * for each wake up can be counted.
+ */
+void zb_osif_go_idle(void)
+{
+    m_zboss_idle = true;
+}
+
+/**@brief Counts the wake up which was left unexplained by main_loop_sleep.
+ *
+ * Called after zboss_main_loop_iteration, which tells whether ZBOSS had
+ * anything to do.
+ */
+static void main_loop_woken(void)
+{
+    if (!m_wake_unexplained)
+    {
+        return;
+    }
+    m_wake_unexplained = false;
+    if (!m_zboss_idle)
+    {
+        m_main_loop_stats.wakeZboss++;
+    }
+    else
+    {
+        m_main_loop_stats.wakeOther++;
+    }
+}
+
+/**@brief Sleeps until the next event, unless there's work waiting.
+ *
+ * ZBOSS runs last in each pass of the main loop, so if it went idle then
+ * nothing which was handled before it left work for it. Interrupts set
+ * the event register, so one which comes in after the checks makes
+ * __WFE return straight away rather than being slept through.
+ */
+static void main_loop_sleep(bool log_pending)
+{
+    if (!m_zboss_idle || log_pending || m_usb_work || m_aps_request_ready || m_param_written)
+    {
+        return;
+    }
+
+    uint32_t sleep_ticks = app_timer_cnt_get();
+    m_main_loop_stats.awakeTicks += app_timer_cnt_diff_compute(sleep_ticks, m_main_loop_ticks);
+    m_main_loop_stats.sleeps++;
+
+    __WFE();
+
+    m_main_loop_ticks = app_timer_cnt_get();
+    uint32_t slept = app_timer_cnt_diff_compute(m_main_loop_ticks, sleep_ticks);
+    m_main_loop_stats.sleepTicks += slept;
+    if (slept > m_main_loop_stats.maxSleep)
+    {
+        m_main_loop_stats.maxSleep = slept;
+    }
+    // The interrupt handlers have run by now, so USB is easy to spot.
+    if (m_usb_work)
+    {
+        m_main_loop_stats.wakeUsb++;
+    }
+    else
+    {
+        m_wake_unexplained = true;
+    }
 }
 
+#endif  // MAIN_LOOP_SLEEP_ENABLED
+
 /**@brief Function for application main entry.
  */
 int main(void)
@@ -354,7 +1032,12 @@ int main(void)
     /* Initialize loging system and GPIOs. */
     log_init();
 
-    SLIP_initParser(&m_slipParser, PacketReceived);
+    CyclesInit();
+
+    for (size_t i = 0; i < ARRAY_SIZE(m_cdc_acm_ports); i++)
+    {
+        PacketPortInit(&m_cdc_acm_ports[i].port, response_ready, &m_cdc_acm_ports[i]);
+    }
 
 #if defined(APP_USBD_ENABLED) && APP_USBD_ENABLED
     ret = nrf_drv_clock_init();
@@ -394,7 +1077,9 @@ int main(void)
     ZB_AF_REGISTER_DEVICE_CTX(&cli_agent_ctx);
 
     /* Set the endpoint receive hook */
-    ZB_AF_SET_ENDPOINT_HANDLER(ZIGBEE_CLI_ENDPOINT, cli_agent_ep_handler);
+    ZB_AF_SET_ENDPOINT_HANDLER(ZIGBEE_CLI_ENDPOINT, deconz_ep_handler);
+
+    aps_request_pool_init();
 
 #if 1
     zb_ext_pan_id_t extPanId;
@@ -419,6 +1104,13 @@ int main(void)
 
     zb_set_nvram_erase_at_start(ERASE_PERSISTENT_CONFIG);
 
+    // zboss_start restores the parameters a host has written (if any)
+    // through param_nvram_read.
+    zb_nvram_register_app1_read_cb(param_nvram_read);
+    zb_nvram_register_app1_write_cb(param_nvram_write, param_nvram_size);
+
+    ParamRefresh();
+
     NRF_LOG_INFO("About to call zboss_start");
     NRF_LOG_PROCESS();
     zb_ret_t zb_err_code = zboss_start();
@@ -427,15 +1119,40 @@ int main(void)
     NRF_LOG_INFO("About to enter main loop");
     NRF_LOG_PROCESS();
 
+    MainLoopResetStats();
+
     /* Start ZigBee stack. */
     while(1)
     {
+        // Everything which can leave work for ZBOSS comes first, so that
+        // it gets done in the same pass.
+        UNUSED_RETURN_VALUE(zb_cli_process());
+        if (m_usb_work)
+        {
+            usb_process();
+        }
+        if (m_aps_request_ready)
+        {
+            aps_requests_send();
+        }
+        if (m_param_written)
+        {
+            params_apply();
+        }
+#if MAIN_LOOP_SLEEP_ENABLED
+        m_zboss_idle = false;
+#endif
         //if (m_stack_started)
         {
             zboss_main_loop_iteration();
         }
-        UNUSED_RETURN_VALUE(NRF_LOG_PROCESS());
-        UNUSED_RETURN_VALUE(zb_cli_process());
+        bool log_pending = NRF_LOG_PROCESS();
+#if MAIN_LOOP_SLEEP_ENABLED
+        main_loop_woken();
+        main_loop_sleep(log_pending);
+#else
+        UNUSED_VARIABLE(log_pending);
+#endif
     }
 }
 
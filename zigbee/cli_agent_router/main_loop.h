@@ -0,0 +1,37 @@
+/**
+ * main_loop.h - main loop sleep and wake up accounting
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.*
+ */
+
+#if !defined(MAIN_LOOP_H)
+#define MAIN_LOOP_H
+
+#include <stdint.h>
+
+#include "sdk_config.h"
+
+// See pca10056/blank/config/sdk_config.h
+#if !defined(MAIN_LOOP_SLEEP_ENABLED)
+#define MAIN_LOOP_SLEEP_ENABLED 1
+#endif
+
+// Times are in RTC ticks (see app_timer_cnt_get), since the cycle
+// counter stops while the CPU sleeps.
+typedef struct {
+  uint32_t  sleeps;       // times the main loop waited for an event
+  uint32_t  wakeUsb;      // woken with USB data or a finished transfer to see to
+  uint32_t  wakeZboss;    // woken with work for ZBOSS (radio, timers)
+  uint32_t  wakeOther;    // woken by anything else (CLI, log, spurious events)
+  uint64_t  sleepTicks;   // total time spent asleep
+  uint64_t  awakeTicks;   // total time spent awake
+  uint32_t  maxSleep;     // longest single sleep
+} MainLoopStats_t;
+
+// Implemented in main.c.
+MainLoopStats_t *MainLoopGetStats(void);
+void MainLoopResetStats(void);
+
+#endif  // MAIN_LOOP_H
@@ -7,6 +7,12 @@
  */
 
 #include "packet.h"
+#include "packet_port.h"
+
+#include "aps.h"
+#include "cycles.h"
+#include "device_state.h"
+#include "param.h"
 
 #include "slip.h"
 #include "nrf_log.h"
@@ -14,13 +20,11 @@
 #include "debug_flags.h"
 
 #include "zboss_api.h"
-#include "nrf_802154.h"
 
-// Worse case is every byte is escaped, plus 2 for an END character
-// at each end.
-#define MAX_SLIP_PACKET_LEN   (MAX_PACKET_LEN * 2 + 2)
+static PacketStats_t m_stats;
 
-uint8_t   outSlipPacket[MAX_SLIP_PACKET_LEN];
+// seqNum used for frames which the device sends of its own accord
+static uint8_t m_unsolicitedSeqNum;
 
 static uint16_t PacketCrc(const Packet_t *packet) {
   uint16_t crc = 0;
@@ -30,65 +34,782 @@ static uint16_t PacketCrc(const Packet_t *packet) {
   return ~crc + 1;
 }
 
-static void SendResponse(PacketHeader_t *response) {
-  Packet_t pkt;
+// Returns the txQueue index offset bytes on from pos.
+static inline size_t QueueIndex(size_t pos, size_t offset) {
+  pos += offset;
+  return pos >= PACKET_TX_QUEUE_SIZE ? pos - PACKET_TX_QUEUE_SIZE : pos;
+}
+
+// Copies len bytes into txQueue at pos, wrapping around the end if
+// need be, and returns the index following them.
+static size_t QueueWrite(PacketPort_t *port, size_t pos, const void *src, size_t len) {
+  size_t firstLen = PACKET_TX_QUEUE_SIZE - pos;
+  if (firstLen > len) {
+    firstLen = len;
+  }
+  memcpy(&port->txQueue[pos], src, firstLen);
+  if (len > firstLen) {
+    memcpy(port->txQueue, (const uint8_t *)src + firstLen, len - firstLen);
+  }
+  return QueueIndex(pos, len);
+}
+
+// Returns true if a frameLen byte response fits in the port's TX queue.
+static inline bool TxRoomFor(const PacketPort_t *port, size_t frameLen) {
+  return frameLen <= PACKET_TX_QUEUE_SIZE - port->txUsed;
+}
+
+// Sends a response made up of several segments, the first of which
+// must start with the PacketHeader_t. The frameLen in the header is
+// filled in here and the CRC is calculated by the SLIP encoder.
+// Returns false if the response couldn't be queued.
+static bool SendResponsev(PacketPort_t *port, const SLIP_Segment_t *seg, size_t numSegs) {
+  const PacketHeader_t *response = seg[0].buf;
+
+  size_t frameLen = 0;
+  for (size_t i = 0; i < numSegs; i++) {
+    frameLen += seg[i].len;
+  }
+  if (frameLen > PACKET_FRAGMENTED_MAX_LEN) {
+    NRF_LOG_ERROR("Response 0x%02x too big", response->commandId);
+    return false;
+  }
+  if (!TxRoomFor(port, frameLen)) {
+    port->txStats.overflow++;
+    NRF_LOG_ERROR("Response 0x%02x dropped - TX queue full", response->commandId);
+    return false;
+  }
+
+  // Only a response which the host is going to see is worth caching.
+  PacketCachedResponse_t *rec = port->recording;
+  if (rec != NULL && response->commandId == rec->commandId &&
+      response->seqNum == rec->seqNum && response->status == STATUS_SUCCESS &&
+      frameLen <= sizeof(rec->buf)) {
+    // Failures aren't kept, since a retry might well succeed.
+    size_t len = 0;
+    for (size_t i = 0; i < numSegs; i++) {
+      memcpy(&rec->buf[len], seg[i].buf, seg[i].len);
+      len += seg[i].len;
+    }
+    rec->buf[3] = frameLen & 0xff;
+    rec->buf[4] = (frameLen >> 8) & 0xff;
+    rec->len = frameLen;
+  }
+
+  // The segments only live as long as the handler which created them,
+  // and the response may not go out until well after that, so they get
+  // gathered into the queue. The frames in the queue are back to back,
+  // and each one's length can be found in its header.
+  size_t head = QueueIndex(port->txTail, port->txUsed);
+  size_t pos = head;
+  for (size_t i = 0; i < numSegs; i++) {
+    pos = QueueWrite(port, pos, seg[i].buf, seg[i].len);
+  }
+  port->txQueue[QueueIndex(head, 3)] = frameLen & 0xff;
+  port->txQueue[QueueIndex(head, 4)] = (frameLen >> 8) & 0xff;
+
+  port->txUsed += frameLen;
+  port->txStats.queued++;
+  if (port->txUsed > port->txStats.highWater) {
+    port->txStats.highWater = port->txUsed;
+  }
+  if (response->status != STATUS_SUCCESS) {
+    m_stats.errors++;
+  }
+  port->txReady(port);
+  return true;
+}
+
+// Points the encoder at the next piece of the (too long) frame at the
+// head of the queue, wrapped in a FRAGMENT.
+static void StartFragment(PacketPort_t *port) {
+  size_t dataLen = port->txFrameLen - port->txFragOffset;
+  if (dataLen > FRAGMENT_MAX_DATA) {
+    dataLen = FRAGMENT_MAX_DATA;
+  }
+  size_t pos = QueueIndex(port->txTail, port->txFragOffset);
+  size_t firstLen = PACKET_TX_QUEUE_SIZE - pos;
+  if (firstLen > dataLen) {
+    firstLen = dataLen;
+  }
+
+  FragmentHeader_t *frag = &port->txFragHdr;
+  frag->hdr.commandId = FRAGMENT;
+  frag->hdr.seqNum = port->txQueue[QueueIndex(port->txTail, 1)];
+  frag->hdr.status = STATUS_SUCCESS;
+  frag->hdr.frameLen = sizeof(*frag) + dataLen;
+  frag->totalLen = port->txFrameLen;
+  frag->offset = port->txFragOffset;
+
+  SLIP_Segment_t seg[] = {
+    { .buf = frag,                .len = sizeof(*frag) },
+    { .buf = &port->txQueue[pos], .len = firstLen },
+    { .buf = port->txQueue,       .len = dataLen - firstLen },
+  };
+  SLIP_initEncoderv(&port->txEncoder, seg, 3);
+  port->txFragLen = dataLen;
+  port->txStats.fragments++;
+}
+
+// Moves on to the next FRAGMENT of the frame being sent. Returns false
+// if the frame wasn't fragmented or that was the last piece.
+static bool NextFragment(PacketPort_t *port) {
+  if (port->txFragLen == 0) {
+    return false;
+  }
+  port->txFragOffset += port->txFragLen;
+  if (port->txFragOffset >= port->txFrameLen) {
+    return false;
+  }
+  StartFragment(port);
+  return true;
+}
 
-  pkt.len = response->frameLen + 2;   // CRC not included in frameLen
-  pkt.buf = (uint8_t *)response;
-  uint16_t crc = PacketCrc(&pkt);
-  pkt.buf[response->frameLen] = crc & 0xff;
-  pkt.buf[response->frameLen + 1] = (crc >> 8) & 0xff;
+// Points the encoder at the oldest frame in the queue, which may wrap
+// around the end of it. Returns false if the queue is empty.
+static bool StartNextResponse(PacketPort_t *port) {
+  if (port->txUsed == 0) {
+    return false;
+  }
+  size_t tail = port->txTail;
+  size_t frameLen = port->txQueue[QueueIndex(tail, 3)] +
+                    (port->txQueue[QueueIndex(tail, 4)] << 8);
+  port->txFrameLen = frameLen;
+  if (frameLen + 2 > MAX_PACKET_LEN) {
+    port->txFragOffset = 0;
+    StartFragment(port);
+    return true;
+  }
+  size_t firstLen = PACKET_TX_QUEUE_SIZE - tail;
+  if (firstLen > frameLen) {
+    firstLen = frameLen;
+  }
+  SLIP_Segment_t seg[] = {
+    { .buf = &port->txQueue[tail], .len = firstLen },
+    { .buf = port->txQueue,        .len = frameLen - firstLen },
+  };
+  SLIP_initEncoderv(&port->txEncoder, seg, 2);
+  return true;
+}
 
-  size_t outLen = SLIP_encapsulate(&pkt, outSlipPacket, sizeof(outSlipPacket));
-  WriteResponse(outSlipPacket, outLen);
+// Frees up the space used by the frame which was being sent.
+static void FinishResponse(PacketPort_t *port) {
+  port->txTail = QueueIndex(port->txTail, port->txFrameLen);
+  port->txUsed -= port->txFrameLen;
+  port->txFrameLen = 0;
+  port->txFragLen = 0;
 }
 
-static void HandleReadParameter(ReadParameter_t *pkt) {
-  ReadParameter_t response;
+// Replies to a request which can't be handled with a header only
+// response, so that the host finds out straight away rather than
+// waiting for its timeout to expire.
+static void SendError(PacketPort_t *port, const PacketHeader_t *request, uint8_t status) {
+  PacketHeader_t response;
+
   memset(&response, 0, sizeof(response));
-  response.hdr.commandId = READ_PARAMETER;
-  response.hdr.seqNum = pkt->hdr.seqNum;
-  response.payloadLen = 1;  // covers parameterId
-  response.parameterId = pkt->parameterId;
+  response.commandId = request->commandId;
+  response.seqNum = request->seqNum;
+  response.status = status;
 
-  switch (pkt->parameterId ) {
-    case PARAM_ID_MAC_ADRESS: {
-      zb_ieee_addr_t addr64;
-      zb_get_long_address(addr64);
-      memcpy(response.addr64, &addr64, sizeof(addr64));
-      response.payloadLen += sizeof(response.addr64);
+  SLIP_Segment_t seg = { .buf = &response, .len = sizeof(response) };
+  SendResponsev(port, &seg, 1);
+}
+
+size_t PacketTxFill(PacketPort_t *port, uint8_t *buf, size_t bufLen) {
+  // Pack as many queued responses as will fit into buf, so that a burst
+  // of them goes out in one transfer rather than one transfer each.
+  size_t txLen = 0;
+  while (txLen < bufLen) {
+    if (port->txFrameLen == 0 && !StartNextResponse(port)) {
       break;
     }
-    case PARAM_ID_PAN_ID64: {
-      zb_ext_pan_id_t extPanId;
-      zb_get_extended_pan_id(extPanId);
-      memcpy(response.addr64, &extPanId, sizeof(extPanId));
-      response.payloadLen += sizeof(response.addr64);
-      break;
+    txLen += SLIP_encodeChunk(&port->txEncoder, &buf[txLen], bufLen - txLen);
+    if (SLIP_encoderDone(&port->txEncoder) && !NextFragment(port)) {
+      // It's all in buf now, so the queue space can be reused.
+      FinishResponse(port);
     }
-    case PARAM_ID_SCAN_CHANNELS: {
-      zb_uint32_t channelMask = zb_get_bdb_primary_channel_set();
-      response.data32 = channelMask;
-      response.payloadLen += sizeof(response.data32);
-      break;
+  }
+  if (txLen > 0) {
+    port->txStats.transfers++;
+  }
+  return txLen;
+}
+
+void PacketTxAbort(PacketPort_t *port) {
+  if (port->txFrameLen > 0) {
+    FinishResponse(port);
+  }
+  port->txEncoder.state = SLIP_ENCODER_DONE;
+  port->txEncoder.pending = 0;
+}
+
+void PacketTxFlush(PacketPort_t *port) {
+  PacketTxAbort(port);
+  port->txTail = 0;
+  port->txUsed = 0;
+}
+
+void PacketTxResetStats(PacketPort_t *port) {
+  memset(&port->txStats, 0, sizeof(port->txStats));
+}
+
+// Drops cached responses to requests which are too far away from
+// seqNum for it to be a retry of them.
+static void ExpireCachedResponses(PacketPort_t *port, uint8_t seqNum) {
+  for (size_t i = 0; i < PACKET_RESPONSE_CACHE_SIZE; i++) {
+    PacketCachedResponse_t *entry = &port->responseCache[i];
+    int8_t distance = (int8_t)(uint8_t)(seqNum - entry->seqNum);
+    if (distance > PACKET_RESPONSE_CACHE_WINDOW || distance < -PACKET_RESPONSE_CACHE_WINDOW) {
+      entry->len = 0;
     }
-    case PARAM_ID_OPERATING_CHANNEL: {
-      uint8_t operatingChannel = nrf_802154_channel_get();
-      response.data8 = operatingChannel;
-      response.payloadLen += sizeof(response.data8);
-      break;
+  }
+}
+
+static const PacketCachedResponse_t *FindCachedResponse(const PacketPort_t *port,
+                                                        const PacketHeader_t *request,
+                                                        uint16_t requestCrc) {
+  for (size_t i = 0; i < PACKET_RESPONSE_CACHE_SIZE; i++) {
+    const PacketCachedResponse_t *entry = &port->responseCache[i];
+    if (entry->len > 0 && entry->commandId == request->commandId &&
+        entry->seqNum == request->seqNum && entry->requestCrc == requestCrc) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static void PortPacketReceived(const Packet_t *packet, void *context) {
+  PacketReceived(context, packet);
+}
+
+void PacketPortInit(PacketPort_t *port, PacketTxReadyCallback txReady, void *context) {
+  SLIP_initParser(&port->parser, PortPacketReceived, port);
+  port->txTail = 0;
+  port->txUsed = 0;
+  port->txFrameLen = 0;
+  port->txFragLen = 0;
+  port->rxFragLen = 0;
+  port->rxHead = 0;
+  port->rxTail = 0;
+  port->rxStarved = false;
+  PacketRxResetStats(port);
+  PacketTxResetStats(port);
+  port->txEncoder.state = SLIP_ENCODER_DONE;
+  port->txEncoder.pending = 0;
+  memset(port->responseCache, 0, sizeof(port->responseCache));
+  port->responseCacheNext = 0;
+  port->recording = NULL;
+  port->txReady = txReady;
+  port->context = context;
+}
+
+void PacketPortReceive(PacketPort_t *port, uint8_t *chunk, size_t chunkLen) {
+  SLIP_parseChunkInPlace(&port->parser, chunk, chunkLen);
+}
+
+// The ring is only shared between one interrupt handler and the main
+// loop on a single core, so the compiler just has to be kept from
+// moving the buffer accesses past the index updates.
+#define COMPILER_BARRIER()  __asm volatile("" ::: "memory")
+
+uint8_t *PacketPortRxBuffer(PacketPort_t *port) {
+  uint16_t head = port->rxHead;
+  if ((uint16_t)(head - port->rxTail) >= PACKET_RX_RING_SIZE) {
+    if (!port->rxStarved) {
+      port->rxStarved = true;
+      port->rxStarvedSince = CyclesNow();
+      port->rxStats.starved++;
+    }
+    return NULL;
+  }
+  if (port->rxStarved) {
+    uint32_t starved = CyclesNow() - port->rxStarvedSince;
+    port->rxStats.starvedCycles += starved;
+    if (starved > port->rxStats.maxStarved) {
+      port->rxStats.maxStarved = starved;
+    }
+    port->rxStarved = false;
+  }
+  return port->rxRing[head % PACKET_RX_RING_SIZE].buf;
+}
+
+void PacketPortRxDone(PacketPort_t *port, size_t len) {
+  uint16_t head = port->rxHead;
+  PacketRxBuffer_t *rx = &port->rxRing[head % PACKET_RX_RING_SIZE];
+  rx->stamp = CyclesNow();
+  rx->len = len;
+  COMPILER_BARRIER();
+  port->rxHead = head + 1;
+
+  port->rxStats.buffers++;
+  port->rxStats.bytes += len;
+  uint16_t used = head + 1 - port->rxTail;
+  if (used > port->rxStats.highWater) {
+    port->rxStats.highWater = used;
+  }
+}
+
+bool PacketPortProcessRx(PacketPort_t *port) {
+  uint16_t tail = port->rxTail;
+  if (tail == port->rxHead) {
+    return false;
+  }
+  do {
+    COMPILER_BARRIER();
+    PacketRxBuffer_t *rx = &port->rxRing[tail % PACKET_RX_RING_SIZE];
+    PacketPortReceive(port, rx->buf, rx->len);
+    uint32_t latency = CyclesNow() - rx->stamp;
+    port->rxStats.handled++;
+    port->rxStats.latency += latency;
+    if (latency > port->rxStats.maxLatency) {
+      port->rxStats.maxLatency = latency;
     }
-    default:
-      NRF_LOG_ERROR("Unrecognized parameter ID: %u", pkt->parameterId);
+    COMPILER_BARRIER();
+    port->rxTail = ++tail;
+  } while (tail != port->rxHead);
+  return true;
+}
+
+void PacketRxResetStats(PacketPort_t *port) {
+  memset(&port->rxStats, 0, sizeof(port->rxStats));
+}
+
+static uint8_t *PutU16(uint8_t *p, uint16_t value) {
+  *p++ = value & 0xff;
+  *p++ = value >> 8;
+  return p;
+}
+
+static inline uint16_t GetU16(const uint8_t *p) {
+  return p[0] | (p[1] << 8);
+}
+
+static void HandleReadParameter(PacketPort_t *port, const Packet_t *packet) {
+  const ReadParameter_t *pkt = (const ReadParameter_t *)packet->buf;
+  ParameterHeader_t response;
+  size_t valueLen = 0;
+
+  const uint8_t *value = ParamGet(pkt->parameterId, &valueLen);
+  if (value == NULL) {
+    NRF_LOG_ERROR("Unrecognized parameter ID: %u", pkt->parameterId);
+  }
+
+  memset(&response, 0, sizeof(response));
+  response.hdr.commandId = READ_PARAMETER;
+  response.hdr.seqNum = pkt->hdr.seqNum;
+  response.hdr.status = valueLen > 0 ? STATUS_SUCCESS : STATUS_UNSUPPORTED;
+  response.payloadLen = 1 + valueLen;  // parameterId + value
+  response.parameterId = pkt->parameterId;
+
+  SLIP_Segment_t seg[] = {
+    { .buf = &response, .len = sizeof(response) },
+    { .buf = value,     .len = valueLen },
+  };
+  SendResponsev(port, seg, value != NULL ? 2 : 1);
+}
+
+// The value is applied to the stack later, from the main loop, so a
+// successful response means that it's been accepted rather than that
+// it's taken effect.
+static void HandleWriteParameter(PacketPort_t *port, const Packet_t *packet) {
+  const ParameterHeader_t *pkt = (const ParameterHeader_t *)packet->buf;
+  const uint8_t *value = &packet->buf[sizeof(ParameterHeader_t)];
+  size_t valueLen = packet->len - 2 - sizeof(ParameterHeader_t);
+  ParameterHeader_t response;
+
+  memset(&response, 0, sizeof(response));
+  response.hdr.commandId = WRITE_PARAMETER;
+  response.hdr.seqNum = pkt->hdr.seqNum;
+  if (pkt->payloadLen != 1 + valueLen) {
+    response.hdr.status = STATUS_INVALID_VALUE;
+  } else {
+    response.hdr.status = ParamWrite(pkt->parameterId, value, valueLen);
+  }
+  response.payloadLen = 1;  // parameterId
+  response.parameterId = pkt->parameterId;
+
+  SLIP_Segment_t seg = { .buf = &response, .len = sizeof(response) };
+  SendResponsev(port, &seg, 1);
+}
+
+// Vendor extension, which saves a host from making a READ_PARAMETER
+// round trip for each parameter when it connects. The request payload
+// is a list of parameter IDs, and an empty list asks for every
+// parameter in the cache. Each one is answered with its ID, length and
+// value, with a length of 0 for IDs which aren't known. Answers longer
+// than MAX_PACKET_LEN go out as FRAGMENTs.
+static void HandleReadParameters(PacketPort_t *port, const Packet_t *packet) {
+  const PacketHeader_t *request = (const PacketHeader_t *)packet->buf;
+  const uint8_t *ids = &packet->buf[sizeof(PacketHeader_t) + 2];
+  size_t numIds = GetU16(&packet->buf[sizeof(PacketHeader_t)]);
+  if (sizeof(PacketHeader_t) + 2 + numIds != packet->len - 2) {
+    SendError(port, request, STATUS_INVALID_VALUE);
+    return;
+  }
+  bool all = numIds == 0;
+  if (all) {
+    numIds = ParamCount();
+  }
+
+  // Too big for the stack. Handlers only ever run one at a time.
+  static uint8_t payload[PACKET_FRAGMENTED_MAX_LEN - sizeof(PacketHeader_t)];
+  PacketHeader_t response;
+  uint8_t *p = &payload[2];
+  for (size_t i = 0; i < numIds; i++) {
+    uint8_t paramId = all ? ParamIdAt(i) : ids[i];
+    size_t valueLen = 0;
+    const uint8_t *value = ParamGet(paramId, &valueLen);
+    if ((size_t)(&payload[sizeof(payload)] - p) < 2 + valueLen) {
+      NRF_LOG_ERROR("READ_PARAMETERS: %u parameters won't fit", numIds);
+      SendError(port, request, STATUS_INVALID_VALUE);
       return;
+    }
+    *p++ = paramId;
+    *p++ = valueLen;
+    if (value != NULL) {
+      memcpy(p, value, valueLen);
+      p += valueLen;
+    }
+  }
+  PutU16(payload, p - &payload[2]);
+
+  memset(&response, 0, sizeof(response));
+  response.commandId = READ_PARAMETERS;
+  response.seqNum = request->seqNum;
+
+  SLIP_Segment_t seg[] = {
+    { .buf = &response, .len = sizeof(response) },
+    { .buf = payload,   .len = p - payload },
+  };
+  SendResponsev(port, seg, 2);
+}
+
+// The first of the two reserved bytes following the state carries the
+// number of free APS_DATA_REQUEST slots, so that a host can keep that
+// many requests in flight.
+static void HandleDeviceState(PacketPort_t *port, const Packet_t *packet) {
+  const PacketHeader_t *request = (const PacketHeader_t *)packet->buf;
+  PacketHeader_t response;
+  uint8_t payload[] = { DeviceStateGet(), ApsRequestFreeSlots(), 0 };
+
+  memset(&response, 0, sizeof(response));
+  response.commandId = DEVICE_STATE;
+  response.seqNum = request->seqNum;
+
+  SLIP_Segment_t seg[] = {
+    { .buf = &response, .len = sizeof(response) },
+    { .buf = payload,   .len = sizeof(payload) },
+  };
+  SendResponsev(port, seg, 2);
+}
+
+// Length of the address (and endpoint) for each destination address
+// mode, or 0 for modes which can't be used as a destination.
+static size_t DstAddressLen(uint8_t addrMode) {
+  switch (addrMode) {
+    case APS_ADDR_MODE_GROUP: return 2;
+    case APS_ADDR_MODE_NWK:   return 2 + 1;
+    case APS_ADDR_MODE_IEEE:  return 8 + 1;
+  }
+  return 0;
+}
+
+static uint8_t *PutDstAddress(uint8_t *p, const ApsRequest_t *req) {
+  *p++ = req->dstAddrMode;
+  if (req->dstAddrMode == APS_ADDR_MODE_IEEE) {
+    memcpy(p, req->dstAddr64, sizeof(req->dstAddr64));
+    p += sizeof(req->dstAddr64);
+  } else {
+    p = PutU16(p, req->dstAddr16);
+  }
+  if (req->dstAddrMode != APS_ADDR_MODE_GROUP) {
+    *p++ = req->dstEndpoint;
+  }
+  return p;
+}
+
+// Queues a frame for ZBOSS to send. The response just acknowledges
+// that it's been accepted; the outcome comes later via APS_DATA_CONFIRM.
+static void HandleApsDataRequest(PacketPort_t *port, const Packet_t *packet) {
+  const PacketHeader_t *request = (const PacketHeader_t *)packet->buf;
+  const uint8_t *p = &packet->buf[sizeof(PacketHeader_t) + 2];
+  const uint8_t *end = &packet->buf[packet->len - 2];
+
+  // requestId, flags and dstAddrMode, followed by the address,
+  // profileId, clusterId, srcEndpoint, asduLen, the asdu, txOptions and
+  // radius.
+  size_t addrLen = end - p >= 3 ? DstAddressLen(p[2]) : 0;
+  if (addrLen == 0 || (size_t)(end - p) < 3 + addrLen + 7) {
+    SendError(port, request, STATUS_INVALID_VALUE);
+    return;
+  }
+  uint8_t requestId = p[0];
+  uint8_t dstAddrMode = p[2];
+  const uint8_t *dstAddr = &p[3];
+  p += 3 + addrLen;
+  uint16_t profileId = GetU16(&p[0]);
+  uint16_t clusterId = GetU16(&p[2]);
+  uint8_t srcEndpoint = p[4];
+  uint16_t asduLen = GetU16(&p[5]);
+  p += 7;
+  if (asduLen > APS_REQUEST_MAX_ASDU || (size_t)(end - p) != asduLen + 2u) {
+    SendError(port, request, STATUS_INVALID_VALUE);
+    return;
+  }
+  if ((DeviceStateGet() & DEVICE_STATE_NET_MASK) != DEVICE_STATE_NET_CONNECTED) {
+    SendError(port, request, STATUS_NO_NETWORK);
+    return;
+  }
+  ApsRequest_t *req = ApsRequestAlloc();
+  if (req == NULL) {
+    SendError(port, request, STATUS_BUSY);
+    return;
+  }
+
+  req->requestId = requestId;
+  req->dstAddrMode = dstAddrMode;
+  if (dstAddrMode == APS_ADDR_MODE_IEEE) {
+    memcpy(req->dstAddr64, dstAddr, sizeof(req->dstAddr64));
+    req->dstEndpoint = dstAddr[8];
+  } else {
+    req->dstAddr16 = GetU16(dstAddr);
+    req->dstEndpoint = dstAddr[2];
+  }
+  req->profileId = profileId;
+  req->clusterId = clusterId;
+  req->srcEndpoint = srcEndpoint;
+  req->asduLen = asduLen;
+  memcpy(req->asdu, p, asduLen);
+  req->txOptions = p[asduLen];
+  req->radius = p[asduLen + 1];
+
+  PacketHeader_t response;
+  memset(&response, 0, sizeof(response));
+  response.commandId = APS_DATA_REQUEST;
+  response.seqNum = request->seqNum;
+  uint8_t payload[] = { 2, 0, 0, requestId };
+
+  // A request which went out without the host hearing about it would
+  // get sent again when the host retries, and its confirm would be for
+  // a requestId the host doesn't know. So unless the response is sure to
+  // be queued the slot is left free and the request isn't carried out.
+  // Taking the slot can queue a DEVICE_STATE_CHANGED on this port ahead
+  // of the response, so there has to be room for that too.
+  size_t stateChangedLen = sizeof(PacketHeader_t) + 1;
+  if (!TxRoomFor(port, stateChangedLen + sizeof(response) + sizeof(payload))) {
+    port->txStats.overflow++;
+    NRF_LOG_ERROR("APS_DATA_REQUEST %u dropped - TX queue full", requestId);
+    return;
+  }
+  ApsRequestSubmit(req);
+  payload[2] = DeviceStateGet();
+
+  SLIP_Segment_t seg[] = {
+    { .buf = &response, .len = sizeof(response) },
+    { .buf = payload,   .len = sizeof(payload) },
+  };
+  SendResponsev(port, seg, 2);
+}
+
+// Hands the host the outcome of the earliest confirmed APS_DATA_REQUEST.
+static void HandleApsDataConfirm(PacketPort_t *port, const Packet_t *packet) {
+  const PacketHeader_t *request = (const PacketHeader_t *)packet->buf;
+  const ApsRequest_t *req = ApsConfirmPeek();
+  if (req == NULL) {
+    SendError(port, request, STATUS_FAILURE);
+    return;
+  }
+
+  uint8_t buf[sizeof(PacketHeader_t) + 2 + 1 + 1 + 10 + 1 + 1 + 4];
+  PacketHeader_t *response = (PacketHeader_t *)buf;
+  memset(buf, 0, sizeof(buf));
+  response->commandId = APS_DATA_CONFIRM;
+  response->seqNum = request->seqNum;
+
+  // Report the state as it will be once this confirm is gone.
+  uint8_t deviceState = DeviceStateGet() | DEVICE_STATE_APS_DATA_REQUEST;
+  if (ApsConfirmCount() <= 1) {
+    deviceState &= ~DEVICE_STATE_APS_DATA_CONFIRM;
+  }
+
+  uint8_t *p = &buf[sizeof(PacketHeader_t) + 2];
+  *p++ = deviceState;
+  *p++ = req->requestId;
+  p = PutDstAddress(p, req);
+  *p++ = req->srcEndpoint;
+  *p++ = req->confirmStatus;
+  p += 4;   // reserved
+  PutU16(&buf[sizeof(PacketHeader_t)], p - buf - sizeof(PacketHeader_t) - 2);
+
+  SLIP_Segment_t seg = { .buf = buf, .len = p - buf };
+  if (SendResponsev(port, &seg, 1)) {
+    ApsConfirmFree();
+  }
+}
+
+// Hands the oldest received indication to the host. The request's
+// payload (length and flags) is accepted but not otherwise used.
+static void HandleApsDataIndication(PacketPort_t *port, const Packet_t *packet) {
+  const PacketHeader_t *request = (const PacketHeader_t *)packet->buf;
+  const ApsIndication_t *ind = ApsIndicationPeek();
+  if (ind == NULL) {
+    SendError(port, request, STATUS_FAILURE);
+    return;
+  }
+
+  // Everything up to the asdu (with room for the largest addresses)
+  uint8_t head[sizeof(PacketHeader_t) + 2 + 1 + 4 + 12 + 2 + 2 + 2];
+  PacketHeader_t *response = (PacketHeader_t *)head;
+  memset(response, 0, sizeof(*response));
+  response->commandId = APS_DATA_INDICATION;
+  response->seqNum = request->seqNum;
+
+  // Report the state as it will be once this indication is gone.
+  uint8_t deviceState = DeviceStateGet() & ~DEVICE_STATE_APS_DATA_INDICATION;
+  if (ApsIndicationCount() > 1) {
+    deviceState |= DEVICE_STATE_APS_DATA_INDICATION;
+  }
+
+  uint8_t *p = &head[sizeof(PacketHeader_t) + 2];
+  *p++ = deviceState;
+  *p++ = ind->dstAddrMode;
+  p = PutU16(p, ind->dstAddr16);
+  if (ind->dstAddrMode != APS_ADDR_MODE_GROUP) {
+    *p++ = ind->dstEndpoint;
+  }
+  *p++ = ind->srcAddrMode;
+  if (ind->srcAddrMode != APS_ADDR_MODE_IEEE) {
+    p = PutU16(p, ind->srcAddr16);
+  }
+  if (ind->srcAddrMode == APS_ADDR_MODE_IEEE || ind->srcAddrMode == APS_ADDR_MODE_NWK_IEEE) {
+    memcpy(p, ind->srcAddr64, sizeof(ind->srcAddr64));
+    p += sizeof(ind->srcAddr64);
+  }
+  *p++ = ind->srcEndpoint;
+  p = PutU16(p, ind->profileId);
+  p = PutU16(p, ind->clusterId);
+  p = PutU16(p, ind->asduLen);
+
+  uint8_t tail[] = { 0, 0, ind->lqi, 0, 0, 0, 0, ind->rssi };
+
+  size_t headLen = p - head;
+  size_t payloadLen = headLen - sizeof(PacketHeader_t) - 2 + ind->asduLen + sizeof(tail);
+  PutU16(&head[sizeof(PacketHeader_t)], payloadLen);
+
+  SLIP_Segment_t seg[] = {
+    { .buf = head,      .len = headLen },
+    { .buf = ind->asdu, .len = ind->asduLen },
+    { .buf = tail,      .len = sizeof(tail) },
+  };
+  if (SendResponsev(port, seg, 3)) {
+    ApsIndicationFree();
+  }
+}
+
+void PacketSendDeviceStateChanged(PacketPort_t *port, uint8_t deviceState) {
+  PacketHeader_t frame;
+
+  memset(&frame, 0, sizeof(frame));
+  frame.commandId = DEVICE_STATE_CHANGED;
+  frame.seqNum = m_unsolicitedSeqNum++;
+
+  SLIP_Segment_t seg[] = {
+    { .buf = &frame,        .len = sizeof(frame) },
+    { .buf = &deviceState,  .len = sizeof(deviceState) },
+  };
+  SendResponsev(port, seg, 2);
+}
+
+static void Dispatch(PacketPort_t *port, const Packet_t *packet, uint16_t frameCrc);
+
+// Puts a request longer than MAX_PACKET_LEN back together (see
+// FragmentHeader_t) and handles it once the last piece has arrived.
+// Only the reassembled request gets a response, unless a piece turns
+// up out of order, in which case the pieces so far are thrown away.
+static void HandleFragment(PacketPort_t *port, const Packet_t *packet) {
+  const FragmentHeader_t *frag = (const FragmentHeader_t *)packet->buf;
+  const uint8_t *data = &packet->buf[sizeof(FragmentHeader_t)];
+  size_t dataLen = packet->len - 2 - sizeof(FragmentHeader_t);
+
+  if (frag->offset == 0) {
+    // A new request, which replaces any that was left unfinished.
+    port->rxFragLen = 0;
+    port->rxFragTotal = frag->totalLen;
+    port->rxFragSeqNum = frag->hdr.seqNum;
+  }
+  if (frag->totalLen != port->rxFragTotal || frag->hdr.seqNum != port->rxFragSeqNum ||
+      frag->offset != port->rxFragLen || dataLen == 0 ||
+      frag->totalLen < sizeof(PacketHeader_t) || frag->totalLen > PACKET_FRAGMENTED_MAX_LEN ||
+      frag->offset + dataLen > frag->totalLen) {
+    NRF_LOG_ERROR("FRAGMENT %u of %u unexpected", frag->offset, frag->totalLen);
+    port->rxFragLen = 0;
+    SendError(port, &frag->hdr, STATUS_INVALID_VALUE);
+    return;
+  }
+  memcpy(&port->rxFragBuf[frag->offset], data, dataLen);
+  port->rxFragLen += dataLen;
+  if (port->rxFragLen < port->rxFragTotal) {
+    return;
+  }
+
+  size_t frameLen = port->rxFragTotal;
+  port->rxFragLen = 0;
+  const PacketHeader_t *hdr = (const PacketHeader_t *)port->rxFragBuf;
+  if (hdr->frameLen != frameLen || hdr->commandId == FRAGMENT) {
+    SendError(port, &frag->hdr, STATUS_INVALID_VALUE);
+    return;
+  }
+  uint16_t crc = 0;
+  for (size_t i = 0; i < frameLen; i++) {
+    crc += port->rxFragBuf[i];
+  }
+  crc = ~crc + 1;
+  port->rxFragBuf[frameLen] = crc & 0xff;
+  port->rxFragBuf[frameLen + 1] = crc >> 8;
+
+  Packet_t assembled = {
+    .len = frameLen + 2, .buf = port->rxFragBuf, .crcKnown = true, .crc = crc
+  };
+  Dispatch(port, &assembled, crc);
+}
+
+typedef void (*CommandHandler_t)(PacketPort_t *port, const Packet_t *packet);
+
+typedef struct {
+  const char       *name;
+  CommandHandler_t  handler;
+  uint16_t          minLen;   // smallest frame (excluding CRC) the handler can deal with
+  bool              cacheResponse;  // resent requests are answered from the response cache
+} Command_t;
+
+// Indexed by commandId. Commands without a handler are left zeroed.
+static const Command_t m_commands[NUM_COMMAND_IDS] = {
+  [APS_DATA_CONFIRM]    = { "APS_DATA_CONFIRM",    HandleApsDataConfirm,    sizeof(PacketHeader_t) },
+  [DEVICE_STATE]        = { "DEVICE_STATE",        HandleDeviceState,       sizeof(PacketHeader_t) },
+  [READ_PARAMETER]      = { "READ_PARAMETER",      HandleReadParameter,     sizeof(ParameterHeader_t) },
+  [WRITE_PARAMETER]     = { "WRITE_PARAMETER",     HandleWriteParameter,    sizeof(ParameterHeader_t), true },
+  [APS_DATA_REQUEST]    = { "APS_DATA_REQUEST",    HandleApsDataRequest,    sizeof(PacketHeader_t) + 2, true },
+  [APS_DATA_INDICATION] = { "APS_DATA_INDICATION", HandleApsDataIndication, sizeof(PacketHeader_t) },
+  [READ_PARAMETERS]     = { "READ_PARAMETERS",     HandleReadParameters,    sizeof(PacketHeader_t) + 2 },
+  [FRAGMENT]            = { "FRAGMENT",            HandleFragment,          sizeof(FragmentHeader_t) + 1 },
+};
+
+const char *PacketCommandName(uint8_t commandId) {
+  if (commandId >= NUM_COMMAND_IDS) {
+    return NULL;
   }
-  response.hdr.frameLen = 7 + response.payloadLen;
-  SendResponse(&response.hdr);
+  return m_commands[commandId].name;
+}
+
+PacketStats_t *PacketGetStats(void) {
+  return &m_stats;
 }
 
-void PacketReceived(const Packet_t *packet) {
-  PacketHeader_t *pktHdr;
+void PacketResetStats(void) {
+  memset(&m_stats, 0, sizeof(m_stats));
+}
 
+void PacketReceived(PacketPort_t *port, const Packet_t *packet) {
   if (packet->len < 8) {
     // The smallest packet is 6 bytes + 2 bytes of CRC
     NRF_LOG_ERROR("Invalid packet (%d bytes) - too small", packet->len);
@@ -101,7 +822,7 @@ void PacketReceived(const Packet_t *packet) {
     return;
   }
   uint16_t frameCrc = packet->buf[frameLen] + (packet->buf[frameLen + 1] << 8);
-  uint16_t expectedCrc = PacketCrc(packet);
+  uint16_t expectedCrc = packet->crcKnown ? packet->crc : PacketCrc(packet);
   if (frameCrc != expectedCrc) {
     NRF_LOG_ERROR("CRC mismatch: expected 0x%04x found: 0x%04x",
                   expectedCrc, frameCrc);
@@ -111,16 +832,77 @@ void PacketReceived(const Packet_t *packet) {
     NRF_LOG_INFO("Rcvd Packet: %d bytes", packet->len - 2);
     NRF_LOG_HEXDUMP_INFO(packet->buf, packet->len - 2);
   }
+  Dispatch(port, packet, frameCrc);
+}
 
-  pktHdr = (PacketHeader_t *)packet->buf;
+// Running total of the cycles timed by Dispatch. HandleFragment calls
+// Dispatch for the reassembled request, and this lets the FRAGMENT's
+// own time leave out what's already been counted against that request.
+static uint32_t m_dispatchCycles;
 
-  switch (pktHdr->commandId) {
-    case READ_PARAMETER:
-      HandleReadParameter((ReadParameter_t *)pktHdr);
-      break;
-    default:
-      NRF_LOG_ERROR("Unrecognized command 0x%02x - ignoring", pktHdr->commandId);
+// Hands a frame which has passed the length and CRC checks to its
+// command's handler.
+static void Dispatch(PacketPort_t *port, const Packet_t *packet, uint16_t frameCrc) {
+  const PacketHeader_t *pktHdr = (const PacketHeader_t *)packet->buf;
+  uint16_t frameLen = packet->len - 2;
+
+  const Command_t *cmd = NULL;
+  if (pktHdr->commandId < NUM_COMMAND_IDS) {
+    cmd = &m_commands[pktHdr->commandId];
+  }
+  if (cmd == NULL || cmd->handler == NULL) {
+    m_stats.unknown++;
+    NRF_LOG_ERROR("Unrecognized command 0x%02x", pktHdr->commandId);
+    SendError(port, pktHdr, STATUS_UNSUPPORTED);
+    return;
+  }
+  PacketCommandStats_t *stats = &m_stats.command[pktHdr->commandId];
+  if (frameLen < cmd->minLen) {
+    stats->tooShort++;
+    NRF_LOG_ERROR("%s too short (%d bytes)", cmd->name, frameLen);
+    SendError(port, pktHdr, STATUS_INVALID_VALUE);
+    return;
+  }
+
+  ExpireCachedResponses(port, pktHdr->seqNum);
+  if (cmd->cacheResponse) {
+    const PacketCachedResponse_t *cached = FindCachedResponse(port, pktHdr, frameCrc);
+    if (cached != NULL) {
+      SLIP_Segment_t seg = { .buf = cached->buf, .len = cached->len };
+      if (SendResponsev(port, &seg, 1)) {
+        port->txStats.replayed++;
+      }
       return;
+    }
+    // The response is recorded on the side, so that the entry it's going
+    // to replace is only lost once there's a response to keep.
+    port->recording = &port->responseScratch;
+    port->recording->len = 0;
+    port->recording->commandId = pktHdr->commandId;
+    port->recording->seqNum = pktHdr->seqNum;
+    port->recording->requestCrc = frameCrc;
+  }
+
+  uint32_t nested = m_dispatchCycles;
+  uint32_t start = CyclesNow();
+  cmd->handler(port, packet);
+  uint32_t elapsed = CyclesNow() - start;
+  uint32_t cycles = elapsed - (m_dispatchCycles - nested);
+  m_dispatchCycles = nested + elapsed;
+
+  if (port->recording != NULL) {
+    const PacketCachedResponse_t *rec = port->recording;
+    if (rec->len > 0) {
+      port->responseCache[port->responseCacheNext] = *rec;
+      port->responseCacheNext = (port->responseCacheNext + 1) % PACKET_RESPONSE_CACHE_SIZE;
+    }
+    port->recording = NULL;
+  }
+
+  stats->calls++;
+  stats->cycles += cycles;
+  if (cycles > stats->maxCycles) {
+    stats->maxCycles = cycles;
   }
 }
 
@@ -9,6 +9,7 @@
 #if !defined(PACKET_H)
 #define PACKET_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include "zboss_api.h"
@@ -23,13 +24,29 @@
 #define APS_DATA_REQUEST      0x12
 #define APS_DATA_INDICATION   0x17
 
+// Vendor extensions, which deCONZ itself doesn't send
+#define READ_PARAMETERS       0x30  // several parameters in one response
+#define FRAGMENT              0x31  // piece of a frame longer than MAX_PACKET_LEN
+
+#define NUM_COMMAND_IDS       (FRAGMENT + 1)
+
+// Values for the status field of a response
+#define STATUS_SUCCESS        0x00
+#define STATUS_FAILURE        0x01
+#define STATUS_BUSY           0x02
+#define STATUS_TIMEOUT        0x03
+#define STATUS_UNSUPPORTED    0x04
+#define STATUS_ERROR          0x05
+#define STATUS_NO_NETWORK     0x06
+#define STATUS_INVALID_VALUE  0x07
+
 // 01  8  Mac address           zb_get_long_address
-// 05  2  PAN ID 16             not used
-// 07  2  NETWORK address 16    0000
+// 05  2  PAN ID 16             ZB_PIBCACHE_PAN_ID
+// 07  2  NETWORK address 16    ZB_PIBCACHE_NETWORK_ADDRESS
 // 08  8  PAN ID 64             zb_get_extended_pan_id
 // 09  1  APS_DESIGNATED COORDINATOR 1 = coordinator, 0 = router
 // 0a  4  SCAN CHANNELS         mask
-// 0b  8  APS_PANID64           not used
+// 0b  8  APS_PANID64           0 (use the network's)
 // 0e  8  TRUST CENTER ADDR64   zb_get_long_address
 // 10  1  SECURITY MODE         3 - 0/None 1/preconfig 2/key from TC 3/No master but TC key
 // 18 16  NETWORK KEY
@@ -38,13 +55,20 @@
 // 22  2  PROTOCOL VERSION
 // 24  1  NETWORK UPDATE ID
 
-#define PARAM_ID_MAC_ADRESS         0x01
-#define PARAM_ID_PAN_ID64           0x08
-#define PARAM_ID_SCAN_CHANNELS      0x0a
-#define PARAM_ID_OPERATING_CHANNEL  0x1c
-#define PARAM_ID_PERMIT_JOIN        0x21
-#define PARAM_ID_PROTOCOL_VERSION   0x22
-#define PARAM_ID_NETWORK_UPDATE_ID  0x24
+#define PARAM_ID_MAC_ADRESS                 0x01
+#define PARAM_ID_PAN_ID16                   0x05
+#define PARAM_ID_NWK_ADDR16                 0x07
+#define PARAM_ID_PAN_ID64                   0x08
+#define PARAM_ID_APS_DESIGNATED_COORDINATOR 0x09
+#define PARAM_ID_SCAN_CHANNELS              0x0a
+#define PARAM_ID_APS_PAN_ID64               0x0b
+#define PARAM_ID_TRUST_CENTER_ADDR64        0x0e
+#define PARAM_ID_SECURITY_MODE              0x10
+#define PARAM_ID_NETWORK_KEY                0x18
+#define PARAM_ID_OPERATING_CHANNEL          0x1c
+#define PARAM_ID_PERMIT_JOIN                0x21
+#define PARAM_ID_PROTOCOL_VERSION           0x22
+#define PARAM_ID_NETWORK_UPDATE_ID          0x24
 
 // The maximum zigbee packet size is 128 bytes (at the PHY layer)
 
@@ -53,16 +77,30 @@
 typedef struct {
   size_t    len;
   uint8_t  *buf;
+
+  // The SLIP parser works out the CRC as it decodes a frame, which
+  // saves PacketReceived from making another pass over it. crc is only
+  // meaningful when crcKnown is set.
+  bool      crcKnown;
+  uint16_t  crc;
 } Packet_t;
 
 typedef struct {
   uint8_t   commandId;
   uint8_t   seqNum;
-  uint8_t   reserved;
+  uint8_t   status;   // reserved in requests
   uint16_t  frameLen;
 
 } __attribute__((packed)) PacketHeader_t;
 
+// Header shared by READ_PARAMETER/WRITE_PARAMETER requests and
+// responses. The parameter value follows.
+typedef struct {
+  PacketHeader_t  hdr;
+  uint16_t        payloadLen;
+  uint8_t         parameterId;
+} __attribute__((packed)) ParameterHeader_t;
+
 typedef struct {
   PacketHeader_t  hdr;
   uint16_t        payloadLen;
@@ -76,9 +114,36 @@ typedef struct {
   uint16_t          crc;  // space for CRC, but not actual location
 } __attribute__((packed)) ReadParameter_t;
 
-void PacketReceived(const Packet_t *packet);
+// Frames longer than MAX_PACKET_LEN (up to PACKET_FRAGMENTED_MAX_LEN)
+// are sent in pieces, each in a FRAGMENT frame of its own which starts
+// with this header. The pieces are the frame's header and payload
+// (without its CRC), in order, and each FRAGMENT carries the seqNum of
+// the frame being sent. Each FRAGMENT has a CRC of its own.
+typedef struct {
+  PacketHeader_t  hdr;
+  uint16_t        totalLen; // of the fragmented frame
+  uint16_t        offset;   // of this piece within it
+} __attribute__((packed)) FragmentHeader_t;
+
+#define FRAGMENT_MAX_DATA (MAX_PACKET_LEN - sizeof(FragmentHeader_t) - 2)
+
+typedef struct {
+  uint32_t  calls;      // frames passed to the handler
+  uint32_t  tooShort;   // frames rejected for being shorter than the handler needs
+  uint64_t  cycles;     // total time spent in the handler
+  uint32_t  maxCycles;
+} PacketCommandStats_t;
+
+typedef struct {
+  PacketCommandStats_t  command[NUM_COMMAND_IDS];  // indexed by commandId
+  uint32_t              unknown;  // frames with a commandId that has no handler
+  uint32_t              errors;   // responses sent with a status other than STATUS_SUCCESS
+} PacketStats_t;
+
+// Returns the name of the command, or NULL if there's no handler for it.
+const char *PacketCommandName(uint8_t commandId);
 
-// Implemented in main.c
-void WriteResponse(uint8_t *buf, size_t bufLen);
+PacketStats_t *PacketGetStats(void);
+void PacketResetStats(void);
 
 #endif // PACKET_H
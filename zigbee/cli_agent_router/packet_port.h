@@ -0,0 +1,216 @@
+/**
+ * packet_port.h - an instance of the deCONZ packet engine
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.*
+ */
+
+#if !defined(PACKET_PORT_H)
+#define PACKET_PORT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "packet.h"
+#include "sdk_config.h"
+#include "slip.h"
+
+// See pca10056/blank/config/sdk_config.h
+#if !defined(PACKET_TX_QUEUE_SIZE)
+#define PACKET_TX_QUEUE_SIZE  1536
+#endif
+
+#if !defined(PACKET_FRAGMENTED_MAX_LEN)
+#define PACKET_FRAGMENTED_MAX_LEN 1024
+#endif
+
+#if PACKET_TX_QUEUE_SIZE < PACKET_FRAGMENTED_MAX_LEN
+#error PACKET_TX_QUEUE_SIZE needs to hold a PACKET_FRAGMENTED_MAX_LEN response
+#endif
+
+#if !defined(PACKET_TX_TRANSFER_SIZE)
+#define PACKET_TX_TRANSFER_SIZE 256
+#endif
+
+#if !defined(PACKET_RX_RING_SIZE)
+#define PACKET_RX_RING_SIZE   8
+#endif
+
+#if (PACKET_RX_RING_SIZE & (PACKET_RX_RING_SIZE - 1)) != 0
+#error PACKET_RX_RING_SIZE has to be a power of 2
+#endif
+
+#if !defined(PACKET_RX_BUFFER_SIZE)
+#define PACKET_RX_BUFFER_SIZE 64
+#endif
+
+// A read only finishes early on a short packet, so buffers are made up
+// of whole full speed bulk packets.
+#if (PACKET_RX_BUFFER_SIZE % 64) != 0
+#error PACKET_RX_BUFFER_SIZE has to be a multiple of 64
+#endif
+
+#if !defined(PACKET_RESPONSE_CACHE_SIZE)
+#define PACKET_RESPONSE_CACHE_SIZE    4
+#endif
+
+#if !defined(PACKET_RESPONSE_CACHE_WINDOW)
+#define PACKET_RESPONSE_CACHE_WINDOW  16
+#endif
+
+struct PacketPort_s;
+
+// Called when a new response is available to be pulled out with
+// PacketTxFill.
+typedef void (*PacketTxReadyCallback)(struct PacketPort_s *port);
+
+typedef struct {
+  uint32_t  queued;     // responses added to the TX queue
+  uint32_t  overflow;   // responses dropped because the TX queue was full
+  uint32_t  transfers;  // buffers filled by PacketTxFill
+  uint32_t  replayed;   // retried requests answered from the response cache
+  uint32_t  fragments;  // FRAGMENTs sent
+  uint16_t  highWater;  // most bytes ever waiting in the TX queue
+} PacketTxStats_t;
+
+// A buffer which the USB stack reads into and which then waits for the
+// main loop.
+typedef struct {
+  uint32_t  stamp;  // CyclesNow() when the read finished
+  uint16_t  len;
+  uint8_t   buf[PACKET_RX_BUFFER_SIZE];
+} PacketRxBuffer_t;
+
+typedef struct {
+  uint32_t  buffers;      // reads finished
+  uint32_t  bytes;        // bytes received in them
+  uint16_t  highWater;    // most buffers waiting at once
+  uint32_t  handled;      // buffers handled by the main loop
+  uint64_t  latency;      // total cycles from a read finishing to having handled it
+  uint32_t  maxLatency;
+  uint32_t  starved;      // times there was no buffer to arm the next read with
+  uint64_t  starvedCycles;  // total time spent without a read armed because of that
+  uint32_t  maxStarved;
+} PacketRxStats_t;
+
+// A response to a request with side effects (such as APS_DATA_REQUEST),
+// kept so that if the host times out and resends the request it gets
+// the same answer again rather than the request being carried out
+// twice. A resent request has the same seqNum and CRC as the original.
+typedef struct {
+  uint8_t   commandId;
+  uint8_t   seqNum;
+  uint16_t  requestCrc;
+  uint16_t  len;        // of the response (excluding CRC), or 0 if unused
+  uint8_t   buf[MAX_PACKET_LEN - 2];
+} PacketCachedResponse_t;
+
+// Everything needed to talk deCONZ over one serial port. Each port has
+// its own parser and TX state, so a large response being sent on one
+// port doesn't hold up requests arriving on another.
+typedef struct PacketPort_s {
+  // Single producer (the USBD event handler), single consumer (the main
+  // loop) ring, which keeps the parsing and handling of requests out of
+  // interrupt context. Each index is only written by one side. They run
+  // freely and are reduced modulo PACKET_RX_RING_SIZE when used. The
+  // buffer at rxHead is the one the next read goes into.
+  PacketRxBuffer_t      rxRing[PACKET_RX_RING_SIZE];
+  volatile uint16_t     rxHead;   // written by the producer
+  volatile uint16_t     rxTail;   // written by the consumer
+  volatile bool         rxStarved;  // no buffer was free for the next read
+  uint32_t              rxStarvedSince;
+  PacketRxStats_t       rxStats;
+
+  SLIP_Parser_t         parser;
+
+  // Responses waiting to be sent, so that a response generated while
+  // the previous one is still going out doesn't get lost. They're kept
+  // unencoded (which takes up to half the space) and get SLIP encoded a
+  // USB packet at a time by PacketTxFill as the endpoint becomes free.
+  uint8_t               txQueue[PACKET_TX_QUEUE_SIZE];
+  uint16_t              txTail;     // start of the oldest response
+  uint16_t              txUsed;     // bytes in the queue
+  uint16_t              txFrameLen; // length of the response being encoded, or 0
+  SLIP_Encoder_t        txEncoder;
+
+  // Responses longer than MAX_PACKET_LEN stay whole in the queue and
+  // get sent a FRAGMENT at a time.
+  FragmentHeader_t      txFragHdr;
+  uint16_t              txFragOffset; // of the piece being encoded
+  uint16_t              txFragLen;    // length of the piece being encoded, or 0
+
+  // Request being put back together from FRAGMENTs
+  uint8_t               rxFragBuf[PACKET_FRAGMENTED_MAX_LEN + 2];  // + CRC
+  uint16_t              rxFragLen;    // bytes received so far, or 0
+  uint16_t              rxFragTotal;
+  uint8_t               rxFragSeqNum;
+  PacketTxStats_t       txStats;
+
+  // Entries are reused oldest first, and dropped once requests with
+  // seqNums more than PACKET_RESPONSE_CACHE_WINDOW away have been seen,
+  // so that a host whose seqNum has wrapped around isn't answered from
+  // the cache.
+  PacketCachedResponse_t responseCache[PACKET_RESPONSE_CACHE_SIZE];
+  uint8_t               responseCacheNext;
+  PacketCachedResponse_t responseScratch; // response being recorded, until it's queued
+  PacketCachedResponse_t *recording;  // &responseScratch while handling a request, or NULL
+
+  PacketTxReadyCallback txReady;
+  void                 *context;  // for use by the owner of the port
+} PacketPort_t;
+
+void PacketPortInit(PacketPort_t *port, PacketTxReadyCallback txReady, void *context);
+
+// Feeds bytes received on the port to its parser. The chunk is decoded
+// in place (see SLIP_parseChunkInPlace) so it gets modified.
+void PacketPortReceive(PacketPort_t *port, uint8_t *chunk, size_t chunkLen);
+
+// Returns the PACKET_RX_BUFFER_SIZE byte buffer for the next read on
+// the port, which stays the same until PacketPortRxDone is called. If
+// every buffer is waiting for the main loop it returns NULL and sets
+// rxStarved, and the read has to be armed again once
+// PacketPortProcessRx has made room.
+uint8_t *PacketPortRxBuffer(PacketPort_t *port);
+
+// Called in interrupt context once len bytes have been read into the
+// buffer from PacketPortRxBuffer, to pass it on to PacketPortProcessRx.
+void PacketPortRxDone(PacketPort_t *port, size_t len);
+
+// Called from the main loop. Passes every buffer which has been read
+// into to PacketPortReceive. Returns true if there were any.
+bool PacketPortProcessRx(PacketPort_t *port);
+
+void PacketRxResetStats(PacketPort_t *port);
+
+// Handles a complete (SLIP decoded) frame received on port.
+void PacketReceived(PacketPort_t *port, const Packet_t *packet);
+
+// Queues an unsolicited DEVICE_STATE_CHANGED frame on port.
+void PacketSendDeviceStateChanged(PacketPort_t *port, uint8_t deviceState);
+
+// Fills buf with as much of the SLIP encoded responses as will fit
+// (frames may be split across calls). Returns 0 once there's nothing
+// left to send.
+size_t PacketTxFill(PacketPort_t *port, uint8_t *buf, size_t bufLen);
+
+// Throws away whatever is left of the response being sent (used when
+// the transport fails part way through). Responses which were already
+// completely in the failed buffer are lost too, but any queued up
+// behind it are left alone.
+void PacketTxAbort(PacketPort_t *port);
+
+// Throws away everything in the TX queue, for when the host has gone
+// away (port closed, USB reset or unplugged) and won't read it. Cached
+// responses are kept, so a retry after the host comes back still gets
+// answered from the cache.
+void PacketTxFlush(PacketPort_t *port);
+
+void PacketTxResetStats(PacketPort_t *port);
+
+// Implemented in main.c
+size_t NumPacketPorts(void);
+PacketPort_t *GetPacketPort(size_t idx);
+
+#endif // PACKET_PORT_H
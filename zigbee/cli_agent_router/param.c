@@ -0,0 +1,134 @@
+/**
+ * param.c - cached deCONZ network parameters
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.*
+ */
+
+#include "param.h"
+
+#include <string.h>
+
+#include "nrf_log.h"
+
+#include "packet.h"
+
+typedef struct {
+  uint8_t   id;
+  uint8_t   len;
+  bool      writable; // by WRITE_PARAMETER
+} ParamInfo_t;
+
+// The parameters listed in packet.h
+static const ParamInfo_t m_paramInfo[] = {
+  { PARAM_ID_MAC_ADRESS,                 8,  false },
+  { PARAM_ID_PAN_ID16,                   2,  false },
+  { PARAM_ID_NWK_ADDR16,                 2,  false },
+  { PARAM_ID_PAN_ID64,                   8,  true  },
+  { PARAM_ID_APS_DESIGNATED_COORDINATOR, 1,  false },
+  { PARAM_ID_SCAN_CHANNELS,              4,  true  },
+  { PARAM_ID_APS_PAN_ID64,               8,  false },
+  { PARAM_ID_TRUST_CENTER_ADDR64,        8,  false },
+  { PARAM_ID_SECURITY_MODE,              1,  false },
+  { PARAM_ID_NETWORK_KEY,                16, true  },
+  { PARAM_ID_OPERATING_CHANNEL,          1,  false },
+  { PARAM_ID_PERMIT_JOIN,                1,  true  },
+  { PARAM_ID_PROTOCOL_VERSION,           2,  false },
+  { PARAM_ID_NETWORK_UPDATE_ID,          1,  false },
+};
+
+#define NUM_PARAMS  (sizeof(m_paramInfo) / sizeof(m_paramInfo[0]))
+
+// Written from ZBOSS signals and read by the packet handlers, which
+// both run from the main loop.
+static uint8_t m_paramValue[NUM_PARAMS][PARAM_MAX_LEN];
+
+// One bit per m_paramInfo entry, set by ParamWrite (packet handlers)
+// and cleared by ParamTakeWritten (main loop).
+static uint32_t m_written;
+
+static ParamStats_t m_stats;
+
+static int ParamIndex(uint8_t paramId) {
+  for (size_t i = 0; i < NUM_PARAMS; i++) {
+    if (m_paramInfo[i].id == paramId) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+const uint8_t *ParamGet(uint8_t paramId, size_t *len) {
+  int idx = ParamIndex(paramId);
+  if (idx < 0) {
+    return NULL;
+  }
+  *len = m_paramInfo[idx].len;
+  return m_paramValue[idx];
+}
+
+size_t ParamCount(void) {
+  return NUM_PARAMS;
+}
+
+uint8_t ParamIdAt(size_t idx) {
+  return m_paramInfo[idx].id;
+}
+
+bool ParamSet(uint8_t paramId, const void *value, size_t len) {
+  int idx = ParamIndex(paramId);
+  if (idx < 0 || len != m_paramInfo[idx].len) {
+    NRF_LOG_ERROR("Bad parameter 0x%02x (%u bytes)", paramId, len);
+    return false;
+  }
+  bool changed = memcmp(m_paramValue[idx], value, len) != 0;
+  if (changed) {
+    memcpy(m_paramValue[idx], value, len);
+  }
+  return changed;
+}
+
+uint8_t ParamWrite(uint8_t paramId, const void *value, size_t len) {
+  int idx = ParamIndex(paramId);
+  if (idx < 0 || !m_paramInfo[idx].writable) {
+    NRF_LOG_ERROR("Parameter 0x%02x can't be written", paramId);
+    m_stats.rejected++;
+    return STATUS_UNSUPPORTED;
+  }
+  if (len != m_paramInfo[idx].len) {
+    NRF_LOG_ERROR("Parameter 0x%02x needs %u bytes, not %u",
+                  paramId, m_paramInfo[idx].len, len);
+    m_stats.rejected++;
+    return STATUS_INVALID_VALUE;
+  }
+  // Even an unchanged value is passed on, since (for example) writing
+  // PERMIT_JOIN again restarts the countdown. main.c works out whether
+  // there's anything new to store.
+  ParamSet(paramId, value, len);
+  m_written |= 1u << idx;
+  m_stats.writes++;
+  ParamWritten();
+  return STATUS_SUCCESS;
+}
+
+bool ParamTakeWritten(uint8_t *paramId) {
+  bool found = false;
+  for (size_t i = 0; i < NUM_PARAMS; i++) {
+    if (m_written & (1u << i)) {
+      m_written &= ~(1u << i);
+      *paramId = m_paramInfo[i].id;
+      found = true;
+      break;
+    }
+  }
+  return found;
+}
+
+ParamStats_t *ParamGetStats(void) {
+  return &m_stats;
+}
+
+void ParamResetStats(void) {
+  memset(&m_stats, 0, sizeof(m_stats));
+}
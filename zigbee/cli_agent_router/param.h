@@ -0,0 +1,78 @@
+/**
+ * param.h - cached deCONZ network parameters
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.*
+ */
+
+#if !defined(PARAM_H)
+#define PARAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Largest parameter value (the network key)
+#define PARAM_MAX_LEN 16
+
+// READ_PARAMETER is answered from a copy of the parameters held here,
+// rather than by asking the stack each time. The values are kept in the
+// byte order they're sent in (little endian).
+
+// Returns the cached value of the parameter and sets *len to its
+// length, or returns NULL if it isn't a parameter the cache knows.
+const uint8_t *ParamGet(uint8_t paramId, size_t *len);
+
+// The parameters the cache knows are numbered 0 to ParamCount() - 1,
+// which lets them all be listed without knowing their IDs.
+size_t ParamCount(void);
+uint8_t ParamIdAt(size_t idx);
+
+// Stores a new value for the parameter. len has to match the
+// parameter's length. Returns true if the value changed.
+bool ParamSet(uint8_t paramId, const void *value, size_t len);
+
+static inline bool ParamSetU8(uint8_t paramId, uint8_t value) {
+  return ParamSet(paramId, &value, sizeof(value));
+}
+
+static inline bool ParamSetU16(uint8_t paramId, uint16_t value) {
+  uint8_t buf[] = { value & 0xff, value >> 8 };
+  return ParamSet(paramId, buf, sizeof(buf));
+}
+
+static inline bool ParamSetU32(uint8_t paramId, uint32_t value) {
+  uint8_t buf[] = { value & 0xff, (value >> 8) & 0xff, (value >> 16) & 0xff, value >> 24 };
+  return ParamSet(paramId, buf, sizeof(buf));
+}
+
+typedef struct {
+  uint32_t  writes;     // parameters written by a host
+  uint32_t  rejected;   // writes to unknown or read only parameters, or with the wrong length
+  uint32_t  commits;    // NVRAM writes made by main.c to persist them
+} ParamStats_t;
+
+// Handles a host's WRITE_PARAMETER. The new value goes into the cache
+// straight away, and ParamWritten is called so that the main loop can
+// apply it to the stack. Returns the STATUS_xxx for the response.
+uint8_t ParamWrite(uint8_t paramId, const void *value, size_t len);
+
+// Implemented in main.c. Called from the WRITE_PARAMETER handler once a
+// parameter has been written.
+void ParamWritten(void);
+
+// Used by the main loop. Returns true and sets *paramId for each
+// parameter written since it was last called. A parameter written
+// several times in between is only returned once, and its latest value
+// is the one in the cache.
+bool ParamTakeWritten(uint8_t *paramId);
+
+ParamStats_t *ParamGetStats(void);
+void ParamResetStats(void);
+
+// Implemented in main.c. Reloads the cache from the stack. Called at
+// startup and on the ZBOSS signals which can change the parameters.
+void ParamRefresh(void);
+
+#endif  // PARAM_H
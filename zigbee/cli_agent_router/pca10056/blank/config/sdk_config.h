@@ -125,6 +125,182 @@
 // </h>
 //==========================================================
 
+// <h> deCONZ
+
+//==========================================================
+// <h> aps - APS data between ZBOSS and the deCONZ host
+
+//==========================================================
+// <o> APS_INDICATION_QUEUE_SIZE - Received APS frames waiting for APS_DATA_INDICATION
+
+
+// <i> Each entry takes around APS_INDICATION_MAX_ASDU + 24 bytes.
+
+#ifndef APS_INDICATION_QUEUE_SIZE
+#define APS_INDICATION_QUEUE_SIZE 8
+#endif
+
+// <o> APS_INDICATION_MAX_ASDU - Largest received ASDU which can be queued
+
+
+// <i> Bigger frames are counted and dropped. The APS_DATA_INDICATION
+// <i> response adds up to 38 bytes to the ASDU and is sent in FRAGMENTs
+// <i> if need be, so this can go up to PACKET_FRAGMENTED_MAX_LEN - 38.
+
+#ifndef APS_INDICATION_MAX_ASDU
+#define APS_INDICATION_MAX_ASDU 80
+#endif
+
+// <q> APS_INDICATION_DROP_OLDEST  - Drop the oldest indication when the queue is full
+
+
+// <i> When set, a frame arriving at a full queue replaces the oldest
+// <i> one, otherwise the new frame is dropped.
+
+#ifndef APS_INDICATION_DROP_OLDEST
+#define APS_INDICATION_DROP_OLDEST 1
+#endif
+
+// <o> APS_REQUEST_QUEUE_SIZE - APS_DATA_REQUESTs which can be in flight
+
+
+// <i> A slot is held from when the request is accepted until the host
+// <i> has read its APS_DATA_CONFIRM. Each slot also reserves a ZBOSS
+// <i> buffer.
+
+#ifndef APS_REQUEST_QUEUE_SIZE
+#define APS_REQUEST_QUEUE_SIZE 4
+#endif
+
+// <o> APS_REQUEST_MAX_ASDU - Largest ASDU accepted in an APS_DATA_REQUEST
+
+#ifndef APS_REQUEST_MAX_ASDU
+#define APS_REQUEST_MAX_ASDU 82
+#endif
+
+// </h>
+//==========================================================
+
+// <h> packet - deCONZ packet engine
+
+//==========================================================
+// <o> PACKET_TX_QUEUE_SIZE - Bytes of responses which can be queued on each port
+
+
+// <i> Responses are queued unencoded, and wait here while the USB
+// <i> endpoint is busy with earlier ones. Has to be at least
+// <i> PACKET_FRAGMENTED_MAX_LEN.
+
+#ifndef PACKET_TX_QUEUE_SIZE
+#define PACKET_TX_QUEUE_SIZE 1536
+#endif
+
+// <o> PACKET_FRAGMENTED_MAX_LEN - Longest frame which can be sent as FRAGMENTs
+
+// <i> Frames longer than MAX_PACKET_LEN (128) are split into FRAGMENT
+// <i> frames (a vendor extension) and put back together at the other
+// <i> end. Each port has a reassembly buffer of this size.
+
+#ifndef PACKET_FRAGMENTED_MAX_LEN
+#define PACKET_FRAGMENTED_MAX_LEN 1024
+#endif
+
+// <o> PACKET_TX_TRANSFER_SIZE - Largest USB transfer used to send responses
+
+
+// <i> Queued responses are packed into transfers of up to this many
+// <i> bytes. Use a multiple of the 64 byte endpoint size.
+
+#ifndef PACKET_TX_TRANSFER_SIZE
+#define PACKET_TX_TRANSFER_SIZE 256
+#endif
+
+// <o> PACKET_RX_RING_SIZE - RX buffers on each port
+
+
+// <i> USB reads go straight into these, and they wait for the main loop
+// <i> to parse and handle them. The next read is armed as soon as one
+// <i> finishes, so the endpoint only NAKs once all of them are waiting
+// <i> (see `stats rx`). Must be a power of 2.
+
+#ifndef PACKET_RX_RING_SIZE
+#define PACKET_RX_RING_SIZE 8
+#endif
+
+// <o> PACKET_RX_BUFFER_SIZE - Size of each RX buffer
+
+
+// <i> A read finishes on a short USB packet or once the buffer is full,
+// <i> so bigger buffers take fewer interrupts under sustained input.
+// <i> Must be a multiple of the 64 byte endpoint size.
+
+#ifndef PACKET_RX_BUFFER_SIZE
+#define PACKET_RX_BUFFER_SIZE 64
+#endif
+
+// <o> PACKET_RESPONSE_CACHE_SIZE - Responses kept on each port for answering retries
+
+
+// <i> Responses to APS_DATA_REQUEST and WRITE_PARAMETER are kept, so
+// <i> that a request the host resends after a timeout isn't carried out
+// <i> twice. Each entry takes MAX_PACKET_LEN + 4 bytes. Must be at least 1.
+
+#ifndef PACKET_RESPONSE_CACHE_SIZE
+#define PACKET_RESPONSE_CACHE_SIZE 4
+#endif
+
+// <o> PACKET_RESPONSE_CACHE_WINDOW - How far the seqNum can move on before a cached response is dropped
+
+
+// <i> A request with the seqNum of a cached response is only treated as
+// <i> a retry while no request more than this many seqNums away from it
+// <i> has been seen. Must be less than 128.
+
+#ifndef PACKET_RESPONSE_CACHE_WINDOW
+#define PACKET_RESPONSE_CACHE_WINDOW 16
+#endif
+
+// </h>
+//==========================================================
+
+// <h> slip - SLIP framing of the deCONZ serial protocol
+
+//==========================================================
+// <q> SLIP_CONFIG_USE_LUT  - Classify bytes using a 256 entry table
+
+
+// <i> When set, SLIP encoding and decoding find the bytes needing
+// <i> escapes by looking each byte up in a table. Otherwise a word at
+// <i> a time is compared against END/ESC. Run the host bench (make -C
+// <i> host bench) to compare the two.
+
+#ifndef SLIP_CONFIG_USE_LUT
+#define SLIP_CONFIG_USE_LUT 0
+#endif
+
+// </h>
+//==========================================================
+
+// <h> main_loop - deCONZ main loop
+
+//==========================================================
+// <q> MAIN_LOOP_SLEEP_ENABLED  - Sleep until there's something to do
+
+
+// <i> When set, the main loop waits for an event (__WFE) once ZBOSS has
+// <i> gone idle and no USB, log or parameter work is waiting, instead of
+// <i> spinning. `stats loop` shows how long it slept and what woke it.
+
+#ifndef MAIN_LOOP_SLEEP_ENABLED
+#define MAIN_LOOP_SLEEP_ENABLED 1
+#endif
+
+// </h>
+//==========================================================
+
+// </h>
+//==========================================================
+
 // <h> nRF_Drivers
 
 //==========================================================
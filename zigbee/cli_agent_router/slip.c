@@ -7,6 +7,9 @@
  */
 
 #include "slip.h"
+
+#include <string.h>
+
 #include "debug_flags.h"
 #include "nrf_log.h"
 
@@ -17,84 +20,475 @@
 #define ESC_END   0xdc    // 0334
 #define ESC_ESC   0xdd    // 0335
 
-void SLIP_initParser(SLIP_Parser_t *parser, SLIP_PacketRcvdCallback cb) {
+void SLIP_initParser(SLIP_Parser_t *parser, SLIP_PacketRcvdCallback cb, void *context) {
   parser->packet.len = 0;
   parser->packet.buf = parser->packetBuf;
   parser->packetRcvdCallback = cb;
+  parser->context = context;
   parser->handling_esc = false;
+  parser->discarding = false;
+  parser->sum = 0;
+  SLIP_resetStats(parser);
 }
 
-void SLIP_parseChunk(SLIP_Parser_t *parser, const uint8_t *chunk, size_t chunkLen) {
+void SLIP_resetStats(SLIP_Parser_t *parser) {
+  memset(&parser->stats, 0, sizeof(parser->stats));
+}
+
+#if SLIP_CONFIG_USE_LUT
+
+// For each byte value, the second byte of the escape sequence used to
+// send it, or 0 if it goes through as is.
+static const uint8_t m_escapeCode[256] = {
+  [END] = ESC_END,
+  [ESC] = ESC_ESC,
+};
+
+// The reverse of m_escapeCode: for each byte which may follow an ESC,
+// the byte that it stands for. Anything else maps to 0.
+static const uint8_t m_unescapeCode[256] = {
+  [ESC_END] = END,
+  [ESC_ESC] = ESC,
+};
+
+// Returns a pointer to the first END or ESC in [src, srcEnd), or srcEnd
+// if there aren't any. The bytes skipped over are added to *sum.
+static const uint8_t *FindSpecial(const uint8_t *src, const uint8_t *srcEnd,
+                                  uint16_t *sum) {
+  uint16_t runSum = 0;
+  while (src < srcEnd && m_escapeCode[*src] == 0) {
+    runSum += *src++;
+  }
+  *sum += runSum;
+  return src;
+}
+
+// Returns the second byte of the escape sequence needed for ch, or 0 if
+// ch doesn't need escaping.
+static inline uint8_t EscapeCode(uint8_t ch) {
+  return m_escapeCode[ch];
+}
+
+// Returns the byte that the character following an ESC stands for.
+static inline uint8_t Unescape(SLIP_Parser_t *parser, uint8_t ch) {
+  uint8_t unescaped = m_unescapeCode[ch];
+  if (unescaped == 0) {
+    // anything else is technically a protocol violation. We just
+    // leave the byte alone.
+    parser->stats.badEscape++;
+    return ch;
+  }
+  return unescaped;
+}
+
+#else // SLIP_CONFIG_USE_LUT
+
+// The fast path in SLIP_parseChunk looks at a machine word at a time
+// (4 bytes on the Cortex-M4, 8 on a 64-bit host). The Cortex-M4 handles
+// unaligned word loads, so no attempt is made to align the reads.
+typedef uintptr_t SLIP_Word_t;
+typedef SLIP_Word_t __attribute__((aligned(1), may_alias)) SLIP_UnalignedWord_t;
+
+#define WORD_ONES   ((SLIP_Word_t)-1 / 0xff)    // 0x01010101...
+#define WORD_HIGHS  (WORD_ONES * 0x80)          // 0x80808080...
+
+// Returns non-zero if any byte in word is zero.
+#define WORD_HAS_ZERO(word) (((word) - WORD_ONES) & ~(word) & WORD_HIGHS)
+
+// Returns non-zero if any byte in word is END or ESC.
+static inline SLIP_Word_t WordHasSpecial(SLIP_Word_t word) {
+  SLIP_Word_t endBytes = word ^ (WORD_ONES * END);
+  SLIP_Word_t escBytes = word ^ (WORD_ONES * ESC);
+  return WORD_HAS_ZERO(endBytes) | WORD_HAS_ZERO(escBytes);
+}
+
+// The bytes of each word are also summed for the deCONZ checksum, using
+// 16-bit lanes. Each lane grows by at most 0x1fe per word, so after
+// LANE_MAX_WORDS words a lane holds at most 0x7f80 and can't carry into
+// the next one.
+#define LANE_ONES       ((SLIP_Word_t)-1 / 0xffff)  // 0x00010001...
+#define LANE_MASK       (LANE_ONES * 0xff)          // 0x00ff00ff...
+#define LANE_MAX_WORDS  64
+
+// Returns the sum (modulo 2^16) of all of the 16-bit lanes in lanes.
+// The lanes are added one at a time: the sum of several of them can be
+// bigger than 0xffff, so summing them with a multiply (by LANE_ONES)
+// would carry into the top lane.
+static inline uint16_t FoldLanes(SLIP_Word_t lanes) {
+  uint16_t sum = 0;
+  for (unsigned i = 0; i < sizeof(SLIP_Word_t) / 2; i++) {
+    sum += lanes & 0xffff;
+    lanes >>= 16;
+  }
+  return sum;
+}
+
+// Returns a pointer to the first END or ESC in [src, srcEnd), or srcEnd
+// if there aren't any. The bytes skipped over are added to *sum.
+static const uint8_t *FindSpecial(const uint8_t *src, const uint8_t *srcEnd,
+                                  uint16_t *sum) {
+  SLIP_Word_t lanes = 0;
+  unsigned laneWords = 0;
+  while ((size_t)(srcEnd - src) >= sizeof(SLIP_Word_t)) {
+    SLIP_Word_t word = *(const SLIP_UnalignedWord_t *)src;
+    if (WordHasSpecial(word)) {
+      break;
+    }
+    lanes += (word & LANE_MASK) + ((word >> 8) & LANE_MASK);
+    src += sizeof(SLIP_Word_t);
+    if (++laneWords == LANE_MAX_WORDS) {
+      *sum += FoldLanes(lanes);
+      lanes = 0;
+      laneWords = 0;
+    }
+  }
+  uint16_t tailSum = FoldLanes(lanes);
+  while (src < srcEnd && *src != END && *src != ESC) {
+    tailSum += *src++;
+  }
+  *sum += tailSum;
+  return src;
+}
+
+// Returns the second byte of the escape sequence needed for ch, or 0 if
+// ch doesn't need escaping.
+static inline uint8_t EscapeCode(uint8_t ch) {
+  switch (ch) {
+    case END:
+      return ESC_END;
+    case ESC:
+      return ESC_ESC;
+  }
+  return 0;
+}
+
+// Returns the byte that the character following an ESC stands for.
+static inline uint8_t Unescape(SLIP_Parser_t *parser, uint8_t ch) {
+  switch (ch) {
+    case ESC_END:
+      return END;
+    case ESC_ESC:
+      return ESC;
+  }
+  // anything else is technically a protocol violation. We just
+  // leave the byte alone.
+  parser->stats.badEscape++;
+  return ch;
+}
+
+#endif // SLIP_CONFIG_USE_LUT
+
+// Hands a complete frame to the callback. sum is the sum of all of the
+// bytes in the frame, which lets the packet's CRC be filled in without
+// having to look at the frame again.
+static void FrameReceived(SLIP_Parser_t *parser, Packet_t *packet, uint16_t sum) {
+  packet->crcKnown = packet->len >= 2;
+  if (packet->crcKnown) {
+    // The last 2 bytes are the CRC itself, which isn't covered by the CRC
+    sum -= packet->buf[packet->len - 2] + packet->buf[packet->len - 1];
+    packet->crc = ~sum + 1;
+  }
+  parser->stats.frames++;
+  parser->packetRcvdCallback(packet, parser->context);
+}
+
+static void ResetFrame(SLIP_Parser_t *parser) {
+  parser->packet.len = 0;
+  parser->handling_esc = false;
+  parser->sum = 0;
+}
+
+// Called when the current frame won't fit in packetBuf. Rather than
+// passing a truncated frame along (which can only fail validation),
+// everything up to the next END is skipped.
+static void DiscardFrame(SLIP_Parser_t *parser) {
+  parser->stats.oversize++;
+  parser->discarding = true;
+  ResetFrame(parser);
+}
+
+static void LogChunk(const uint8_t *chunk, size_t chunkLen) {
   if (DEBUG_slip) {
     NRF_LOG_INFO("Rcvd SLIP Chunk: %d bytes", chunkLen);
     NRF_LOG_HEXDUMP_INFO(chunk, chunkLen);
   }
-  for (size_t i = chunkLen; i > 0; --i) {
+}
+
+static void ParseChunk(SLIP_Parser_t *parser, const uint8_t *chunk, size_t chunkLen) {
+  const uint8_t *chunkEnd = &chunk[chunkLen];
+  while (chunk < chunkEnd) {
+    if (parser->discarding) {
+      const uint8_t *frameEnd = memchr(chunk, END, chunkEnd - chunk);
+      if (frameEnd == NULL) {
+        break;
+      }
+      chunk = frameEnd + 1;
+      parser->discarding = false;
+      continue;
+    }
+    if (!parser->handling_esc) {
+      // Most bytes are neither END nor ESC, so copy runs of ordinary
+      // bytes in bulk and only drop into the state machine below for
+      // the special ones.
+      const uint8_t *run = chunk;
+      chunk = FindSpecial(chunk, chunkEnd, &parser->sum);
+      size_t runLen = chunk - run;
+      if (runLen > sizeof(parser->packetBuf) - parser->packet.len) {
+        DiscardFrame(parser);
+        continue;
+      }
+      memcpy(&parser->packetBuf[parser->packet.len], run, runLen);
+      parser->packet.len += runLen;
+      if (chunk >= chunkEnd) {
+        break;
+      }
+    }
     uint8_t ch = *chunk++;
     if (parser->handling_esc) {
-      switch (ch) {
-        case ESC_END:
-          ch = END;
-          break;
-        case ESC_ESC:
-          ch = ESC;
-          break;
-        // anything else is technically a protocol violation. We just
-        // leave the byte alone.
-      }
       parser->handling_esc = false;
-      if (parser->packet.len < sizeof(parser->packetBuf)) {
-        parser->packetBuf[parser->packet.len++] = ch;
+      if (ch == END) {
+        // An END always ends the frame, even straight after an ESC, so
+        // that a frame can't run on into the next one. What came before
+        // it is incomplete, so it's dropped.
+        parser->stats.badEscape++;
+        ResetFrame(parser);
+        continue;
+      }
+      if (parser->packet.len >= sizeof(parser->packetBuf)) {
+        DiscardFrame(parser);
+        continue;
       }
+      ch = Unescape(parser, ch);
+      parser->sum += ch;
+      parser->packetBuf[parser->packet.len++] = ch;
       continue;
     }
     switch (ch) {
       case END:
         if (parser->packet.len == 0) {
           // Back to back ENDs - ignore
+          parser->stats.empty++;
           continue;
         }
         // Otherwise we've gotten to the end of the packet.
-        parser->packetRcvdCallback(&parser->packet);
-        parser->packet.len = 0;
-        parser->handling_esc = false;
+        FrameReceived(parser, &parser->packet, parser->sum);
+        ResetFrame(parser);
         break;
       case ESC:
         parser->handling_esc = true;
         break;
-      default:
-      if (parser->packet.len < sizeof(parser->packetBuf)) {
-        parser->packetBuf[parser->packet.len++] = ch;
-      }
+    }
+  }
+}
+
+void SLIP_parseChunk(SLIP_Parser_t *parser, const uint8_t *chunk, size_t chunkLen) {
+  LogChunk(chunk, chunkLen);
+  ParseChunk(parser, chunk, chunkLen);
+}
+
+void SLIP_parseChunkInPlace(SLIP_Parser_t *parser, uint8_t *chunk, size_t chunkLen) {
+  uint8_t *chunkEnd = &chunk[chunkLen];
+
+  LogChunk(chunk, chunkLen);
+
+  if (parser->packet.len > 0 || parser->handling_esc || parser->discarding) {
+    // Finish off the frame started by an earlier chunk using packetBuf.
+    // Every END terminates a frame, even one which follows an ESC (the
+    // parser drops such a frame), so the frame ends at the first END in
+    // the chunk and it's safe to split the chunk there.
+    uint8_t *frameEnd = memchr(chunk, END, chunkLen);
+    if (frameEnd == NULL) {
+      ParseChunk(parser, chunk, chunkLen);
+      return;
+    }
+    frameEnd++;
+    ParseChunk(parser, chunk, frameEnd - chunk);
+    chunk = frameEnd;
+  }
+
+  // Decoded data is never longer than the encoded data, so frames are
+  // decoded into the bytes that they occupied in the chunk. dst only
+  // falls behind src once an escape sequence has been seen.
+  uint8_t *src = chunk;
+  uint8_t *dst = chunk;
+  uint8_t *frame = chunk;
+  uint16_t sum = 0;
+  while (src < chunkEnd) {
+    uint8_t *run = src;
+    src = (uint8_t *)FindSpecial(src, chunkEnd, &sum);
+    size_t runLen = src - run;
+    if (dst != run) {
+      memmove(dst, run, runLen);
+    }
+    dst += runLen;
+    if (src >= chunkEnd) {
       break;
     }
+    uint8_t ch = *src++;
+    if (ch == ESC) {
+      if (src >= chunkEnd) {
+        parser->handling_esc = true;
+        break;
+      }
+      if (*src == END) {
+        // As in ParseChunk, the END ends the frame and the frame is
+        // dropped.
+        parser->stats.badEscape++;
+        src++;
+        frame = dst = src;
+        sum = 0;
+        continue;
+      }
+      ch = Unescape(parser, *src++);
+      sum += ch;
+      *dst++ = ch;
+      continue;
+    }
+    // END
+    Packet_t packet;
+    packet.buf = frame;
+    packet.len = dst - frame;
+    if (packet.len == 0) {
+      parser->stats.empty++;
+    } else if (packet.len > MAX_PACKET_LEN) {
+      parser->stats.oversize++;
+    } else {
+      FrameReceived(parser, &packet, sum);
+    }
+    frame = dst = src;
+    sum = 0;
   }
+
+  // Whatever is left is the start of a frame which continues in the
+  // next chunk, so it needs to be kept in packetBuf.
+  size_t partialLen = dst - frame;
+  if (partialLen > sizeof(parser->packetBuf)) {
+    DiscardFrame(parser);
+    return;
+  }
+  memcpy(parser->packetBuf, frame, partialLen);
+  parser->packet.len = partialLen;
+  parser->sum = sum;
 }
 
-size_t SLIP_encapsulate(const Packet_t *packet, uint8_t *outBuf, size_t outBufLen) {
-  const uint8_t *src = packet->buf;
+static void InitEncoder(SLIP_Encoder_t *encoder, const SLIP_Segment_t *seg,
+                        size_t numSegs, bool appendCrc) {
+  if (numSegs > SLIP_MAX_SEGMENTS) {
+    NRF_LOG_ERROR("SLIP frame has too many segments (%d)", numSegs);
+    numSegs = SLIP_MAX_SEGMENTS;
+  }
+  memcpy(encoder->seg, seg, numSegs * sizeof(*seg));
+  encoder->numSegs = numSegs;
+  encoder->segIdx = 0;
+  encoder->src = NULL;
+  encoder->srcLen = 0;
+  encoder->appendCrc = appendCrc;
+  encoder->sum = 0;
+  encoder->pending = 0;
+  encoder->state = SLIP_ENCODER_START;
+}
+
+void SLIP_initEncoder(SLIP_Encoder_t *encoder, const Packet_t *packet) {
+  SLIP_Segment_t seg = { .buf = packet->buf, .len = packet->len };
+  InitEncoder(encoder, &seg, 1, false);
+}
+
+void SLIP_initEncoderv(SLIP_Encoder_t *encoder, const SLIP_Segment_t *seg, size_t numSegs) {
+  InitEncoder(encoder, seg, numSegs, true);
+}
+
+// Moves the encoder on to the next segment with something in it,
+// finishing up with the CRC (if requested). Returns false once there's
+// nothing left to encode.
+static bool NextSegment(SLIP_Encoder_t *encoder) {
+  while (encoder->segIdx < encoder->numSegs) {
+    const SLIP_Segment_t *seg = &encoder->seg[encoder->segIdx++];
+    if (seg->len > 0) {
+      encoder->src = seg->buf;
+      encoder->srcLen = seg->len;
+      return true;
+    }
+  }
+  if (encoder->appendCrc) {
+    uint16_t crc = ~encoder->sum + 1;
+    encoder->crc[0] = crc & 0xff;
+    encoder->crc[1] = (crc >> 8) & 0xff;
+    encoder->appendCrc = false;
+    encoder->src = encoder->crc;
+    encoder->srcLen = sizeof(encoder->crc);
+    return true;
+  }
+  return false;
+}
+
+size_t SLIP_encodeChunk(SLIP_Encoder_t *encoder, uint8_t *outBuf, size_t outBufLen) {
   uint8_t *dst = outBuf;
   uint8_t *dstEnd = &outBuf[outBufLen];
 
-  #define STORE(ch) if (dst < dstEnd ) { *dst++ = ch; }
-  STORE(END)
-  for (size_t i = packet->len; i > 0; --i) {
-    uint8_t ch = *src++;
-    switch (ch) {
-      case END:
-        STORE(ESC)
-        STORE(ESC_END)
+  while (dst < dstEnd) {
+    if (encoder->pending) {
+      // Second half of an escape sequence which didn't fit last time.
+      *dst++ = encoder->pending;
+      encoder->pending = 0;
+      continue;
+    }
+    switch (encoder->state) {
+      case SLIP_ENCODER_START:
+        *dst++ = END;
+        encoder->state = SLIP_ENCODER_BODY;
         break;
-      case ESC:
-        STORE(ESC)
-        STORE(ESC_ESC)
+
+      case SLIP_ENCODER_BODY: {
+        if (encoder->srcLen == 0 && !NextSegment(encoder)) {
+          encoder->state = SLIP_ENCODER_FINISH;
+          break;
+        }
+        // Copy as much as we can up to the next byte needing an escape.
+        // The checksum is accumulated along the way.
+        size_t runLen = dstEnd - dst;
+        if (runLen > encoder->srcLen) {
+          runLen = encoder->srcLen;
+        }
+        const uint8_t *run = encoder->src;
+        runLen = FindSpecial(run, &run[runLen], &encoder->sum) - run;
+        memcpy(dst, run, runLen);
+        dst += runLen;
+        encoder->src += runLen;
+        encoder->srcLen -= runLen;
+        if (dst >= dstEnd || encoder->srcLen == 0) {
+          break;
+        }
+        uint8_t ch = *encoder->src++;
+        encoder->srcLen--;
+        encoder->sum += ch;
+        encoder->pending = EscapeCode(ch);
+        *dst++ = encoder->pending ? ESC : ch;
         break;
-      default:
-        STORE(ch)
+      }
+
+      case SLIP_ENCODER_FINISH:
+        *dst++ = END;
+        encoder->state = SLIP_ENCODER_DONE;
         break;
+
+      case SLIP_ENCODER_DONE:
+        return dst - outBuf;
     }
   }
-  STORE(END)
-  #undef STORE
   return dst - outBuf;
 }
+
+size_t SLIP_encapsulate(const Packet_t *packet, uint8_t *outBuf, size_t outBufLen) {
+  SLIP_Encoder_t encoder;
+
+  SLIP_initEncoder(&encoder, packet);
+  return SLIP_encodeChunk(&encoder, outBuf, outBufLen);
+}
+
+size_t SLIP_encapsulatev(const SLIP_Segment_t *seg, size_t numSegs,
+                         uint8_t *outBuf, size_t outBufLen) {
+  SLIP_Encoder_t encoder;
+
+  SLIP_initEncoderv(&encoder, seg, numSegs);
+  return SLIP_encodeChunk(&encoder, outBuf, outBufLen);
+}
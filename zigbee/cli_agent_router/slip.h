@@ -14,20 +14,104 @@
 #include <stdbool.h>
 
 #include "packet.h"
+#include "sdk_config.h"
 
-typedef void (*SLIP_PacketRcvdCallback)(const Packet_t *packet);
+// See pca10056/blank/config/sdk_config.h
+#if !defined(SLIP_CONFIG_USE_LUT)
+#define SLIP_CONFIG_USE_LUT 0
+#endif
+
+// context is whatever was passed to SLIP_initParser, which allows one
+// callback to serve several parsers.
+typedef void (*SLIP_PacketRcvdCallback)(const Packet_t *packet, void *context);
+
+typedef struct {
+  uint32_t  frames;     // frames passed to the callback
+  uint32_t  oversize;   // frames dropped for being longer than MAX_PACKET_LEN
+  uint32_t  badEscape;  // ESC followed by something other than ESC_END/ESC_ESC
+  uint32_t  empty;      // END with no frame data (i.e. back to back ENDs)
+} SLIP_Stats_t;
 
 typedef struct {
   Packet_t  packet;
   uint8_t   packetBuf[MAX_PACKET_LEN];
   bool      handling_esc;
+  bool      discarding; // skipping an oversize frame until the next END
+  uint16_t  sum;  // sum of the bytes decoded so far in the current frame
 
   SLIP_PacketRcvdCallback packetRcvdCallback;
+  void                   *context;
+
+  SLIP_Stats_t  stats;
 
 } SLIP_Parser_t;
 
-void SLIP_initParser(SLIP_Parser_t *parser, SLIP_PacketRcvdCallback cb);
+typedef enum {
+  SLIP_ENCODER_START,   // leading END still to be sent
+  SLIP_ENCODER_BODY,
+  SLIP_ENCODER_FINISH,  // trailing END still to be sent
+  SLIP_ENCODER_DONE,
+} SLIP_EncoderState_t;
+
+// One piece of a frame to be encoded. This allows a frame to be built
+// from (say) a header on the stack and a payload living somewhere else
+// without first copying them together.
+typedef struct {
+  const void   *buf;
+  size_t        len;
+} SLIP_Segment_t;
+
+#define SLIP_MAX_SEGMENTS   4
+
+// Resumable encoder, which allows a frame to be SLIP encoded straight
+// into USB packet sized buffers, a piece at a time.
+typedef struct {
+  SLIP_Segment_t        seg[SLIP_MAX_SEGMENTS];
+  uint8_t               numSegs;
+  uint8_t               segIdx;   // next segment to be encoded
+  const uint8_t        *src;
+  size_t                srcLen;   // bytes of src not yet encoded
+  bool                  appendCrc;
+  uint16_t              sum;      // sum of the bytes encoded so far
+  uint8_t               crc[2];
+  uint8_t               pending;  // 2nd byte of an escape sequence, or 0
+  SLIP_EncoderState_t   state;
+} SLIP_Encoder_t;
+
+void SLIP_initParser(SLIP_Parser_t *parser, SLIP_PacketRcvdCallback cb, void *context);
+void SLIP_resetStats(SLIP_Parser_t *parser);
 void SLIP_parseChunk(SLIP_Parser_t *parser, const uint8_t *chunk, size_t chunkLen);
+
+// Like SLIP_parseChunk, but frames which are completely contained in
+// the chunk are decoded in place and the packet passed to the callback
+// points into chunk, so chunk is modified. Frames which span chunks are
+// still assembled in packetBuf.
+void SLIP_parseChunkInPlace(SLIP_Parser_t *parser, uint8_t *chunk, size_t chunkLen);
+
+// Encodes a frame into outBuf in one go. If outBuf is too small the
+// frame is truncated.
 size_t SLIP_encapsulate(const Packet_t *packet, uint8_t *outBuf, size_t outBufLen);
 
+// Encodes the concatenation of the segments, followed by the deCONZ CRC
+// (which is calculated during the encoding).
+size_t SLIP_encapsulatev(const SLIP_Segment_t *seg, size_t numSegs,
+                         uint8_t *outBuf, size_t outBufLen);
+
+// packet->buf needs to stay valid until SLIP_encoderDone returns true.
+void SLIP_initEncoder(SLIP_Encoder_t *encoder, const Packet_t *packet);
+
+// Like SLIP_initEncoder, but the frame is made up of up to
+// SLIP_MAX_SEGMENTS segments and has the deCONZ CRC appended, as with
+// SLIP_encapsulatev. The segment list itself is copied, but the data
+// it points to needs to stay valid until SLIP_encoderDone returns true.
+void SLIP_initEncoderv(SLIP_Encoder_t *encoder, const SLIP_Segment_t *seg, size_t numSegs);
+
+// Encodes as much of the frame as will fit in outBuf and returns the
+// number of bytes stored.
+size_t SLIP_encodeChunk(SLIP_Encoder_t *encoder, uint8_t *outBuf, size_t outBufLen);
+
+static inline bool SLIP_encoderDone(const SLIP_Encoder_t *encoder) {
+  return encoder->state == SLIP_ENCODER_DONE && encoder->pending == 0;
+}
+
 #endif // SLIP_H
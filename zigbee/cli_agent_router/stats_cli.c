@@ -0,0 +1,181 @@
+/**
+ * stats_cli.c - statistics command line interface
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.*
+ */
+
+#include "nordic_common.h"
+#include "nrf_cli.h"
+
+#include "aps.h"
+#include "main_loop.h"
+#include "packet.h"
+#include "packet_port.h"
+#include "param.h"
+#include "slip.h"
+
+static void stats_aps(nrf_cli_t const * p_cli, size_t argc, char **argv)
+{
+  const ApsIndicationStats_t *stats = ApsIndicationGetStats();
+
+  nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "indications\r\n");
+  nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "  received: %lu\r\n", stats->received);
+  nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, " delivered: %lu\r\n", stats->delivered);
+  nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "   dropped: %lu (%s)\r\n", stats->dropped,
+                  APS_INDICATION_DROP_OLDEST ? "oldest" : "newest");
+  nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "  oversize: %lu\r\n", stats->oversize);
+  nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "high water: %u of %u\r\n",
+                  stats->highWater, APS_INDICATION_QUEUE_SIZE);
+  nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "    queued: %u\r\n", (unsigned)ApsIndicationCount());
+
+  const ApsRequestStats_t *req = ApsRequestGetStats();
+
+  nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "requests\r\n");
+  nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, " submitted: %lu\r\n", req->submitted);
+  nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "      busy: %lu\r\n", req->busy);
+  nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, " confirmed: %lu\r\n", req->confirmed);
+  nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "    failed: %lu\r\n", req->failed);
+  nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, " delivered: %lu\r\n", req->delivered);
+  nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "high water: %u of %u\r\n",
+                  req->highWater, APS_REQUEST_QUEUE_SIZE);
+  nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "      free: %u\r\n", (unsigned)ApsRequestFreeSlots());
+}
+
+static void stats_loop(nrf_cli_t const * p_cli, size_t argc, char **argv)
+{
+  const MainLoopStats_t *stats = MainLoopGetStats();
+
+  if (!MAIN_LOOP_SLEEP_ENABLED) {
+    nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "sleeping is disabled (MAIN_LOOP_SLEEP_ENABLED)\r\n");
+    return;
+  }
+  uint64_t total = stats->sleepTicks + stats->awakeTicks;
+  nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "    sleeps: %lu\r\n", stats->sleeps);
+  nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "woken by\r\n");
+  nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "       usb: %lu\r\n", stats->wakeUsb);
+  nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "     zboss: %lu\r\n", stats->wakeZboss);
+  nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "     other: %lu\r\n", stats->wakeOther);
+  nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "    asleep: %lu.%lu%% (longest %lu ticks)\r\n",
+                  total ? (uint32_t)(stats->sleepTicks * 100 / total) : 0,
+                  total ? (uint32_t)(stats->sleepTicks * 1000 / total % 10) : 0,
+                  stats->maxSleep);
+}
+
+static void stats_param(nrf_cli_t const * p_cli, size_t argc, char **argv)
+{
+  const ParamStats_t *stats = ParamGetStats();
+
+  nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "   writes: %lu\r\n", stats->writes);
+  nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, " rejected: %lu\r\n", stats->rejected);
+  nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "  commits: %lu\r\n", stats->commits);
+}
+
+static void stats_rx(nrf_cli_t const * p_cli, size_t argc, char **argv)
+{
+  for (size_t i = 0; i < NumPacketPorts(); i++) {
+    const PacketRxStats_t *stats = &GetPacketPort(i)->rxStats;
+
+    nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "port %u\r\n", (unsigned)i);
+    nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "   buffers: %lu (%lu bytes)\r\n",
+                    stats->buffers, stats->bytes);
+    nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "high water: %u of %u buffers\r\n",
+                    stats->highWater, PACKET_RX_RING_SIZE);
+    nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "   starved: %lu (%lu max, %lu total cycles)\r\n",
+                    stats->starved, stats->maxStarved, (uint32_t)stats->starvedCycles);
+    nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "   latency: %lu avg, %lu max cycles\r\n",
+                    stats->handled ? (uint32_t)(stats->latency / stats->handled) : 0,
+                    stats->maxLatency);
+  }
+}
+
+static void stats_slip(nrf_cli_t const * p_cli, size_t argc, char **argv)
+{
+  for (size_t i = 0; i < NumPacketPorts(); i++) {
+    const SLIP_Stats_t *stats = &GetPacketPort(i)->parser.stats;
+
+    nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "port %u\r\n", (unsigned)i);
+    nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "    frames: %lu\r\n", stats->frames);
+    nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "  oversize: %lu\r\n", stats->oversize);
+    nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "bad escape: %lu\r\n", stats->badEscape);
+    nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "     empty: %lu\r\n", stats->empty);
+  }
+}
+
+static void stats_tx(nrf_cli_t const * p_cli, size_t argc, char **argv)
+{
+  for (size_t i = 0; i < NumPacketPorts(); i++) {
+    const PacketPort_t *port = GetPacketPort(i);
+    const PacketTxStats_t *stats = &port->txStats;
+
+    nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "port %u\r\n", (unsigned)i);
+    nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "    queued: %lu\r\n", stats->queued);
+    nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "  overflow: %lu\r\n", stats->overflow);
+    nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, " transfers: %lu\r\n", stats->transfers);
+    nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "  replayed: %lu\r\n", stats->replayed);
+    nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, " fragments: %lu\r\n", stats->fragments);
+    nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "high water: %u of %u bytes\r\n",
+                    stats->highWater, PACKET_TX_QUEUE_SIZE);
+    nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "      used: %u bytes\r\n", port->txUsed);
+  }
+}
+
+static void stats_commands(nrf_cli_t const * p_cli, size_t argc, char **argv)
+{
+  const PacketStats_t *stats = PacketGetStats();
+
+  nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "%-20s %8s %9s %10s %10s\r\n",
+                  "command", "calls", "too short", "avg cycles", "max cycles");
+  for (unsigned id = 0; id < NUM_COMMAND_IDS; id++) {
+    const PacketCommandStats_t *cmd = &stats->command[id];
+    const char *name = PacketCommandName(id);
+    if (name == NULL) {
+      continue;
+    }
+    nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "%-20s %8lu %9lu %10lu %10lu\r\n",
+                    name, cmd->calls, cmd->tooShort,
+                    cmd->calls ? (uint32_t)(cmd->cycles / cmd->calls) : 0,
+                    cmd->maxCycles);
+  }
+  nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, "unknown commands: %lu\r\n", stats->unknown);
+  nrf_cli_fprintf(p_cli, NRF_CLI_NORMAL, " error responses: %lu\r\n", stats->errors);
+}
+
+static void stats_reset(nrf_cli_t const * p_cli, size_t argc, char **argv)
+{
+  for (size_t i = 0; i < NumPacketPorts(); i++) {
+    SLIP_resetStats(&GetPacketPort(i)->parser);
+    PacketRxResetStats(GetPacketPort(i));
+    PacketTxResetStats(GetPacketPort(i));
+  }
+  PacketResetStats();
+  ApsIndicationResetStats();
+  ApsRequestResetStats();
+  ParamResetStats();
+  MainLoopResetStats();
+}
+
+NRF_CLI_CREATE_STATIC_SUBCMD_SET(m_sub_stats)
+{
+    NRF_CLI_CMD(aps, NULL, "APS indication and request queue counters", stats_aps),
+    NRF_CLI_CMD(commands, NULL, "per command call counts and handler cycles", stats_commands),
+    NRF_CLI_CMD(loop, NULL, "main loop sleeps and what woke it", stats_loop),
+    NRF_CLI_CMD(param, NULL, "parameter write and NVRAM commit counters", stats_param),
+    NRF_CLI_CMD(reset, NULL, "reset all of the counters", stats_reset),
+    NRF_CLI_CMD(rx, NULL, "RX buffer counters, starvation and latency", stats_rx),
+    NRF_CLI_CMD(slip, NULL, "SLIP parser frame and drop counters", stats_slip),
+    NRF_CLI_CMD(tx, NULL, "TX queue counters", stats_tx),
+    NRF_CLI_SUBCMD_SET_END
+};
+
+static void stats_cmd(const nrf_cli_t *p_cli, size_t argc, char **argv) {
+  if ((argc == 1) || nrf_cli_help_requested(p_cli)) {
+    nrf_cli_help_print(p_cli, NULL, 0);
+    return;
+  }
+
+  nrf_cli_fprintf(p_cli, NRF_CLI_ERROR, "%s:%s%s\r\n", argv[0], " unknown parameter: ", argv[1]);
+}
+
+NRF_CLI_CMD_REGISTER(stats, &m_sub_stats, "Commands for displaying runtime statistics", stats_cmd);
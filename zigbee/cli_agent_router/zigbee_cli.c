@@ -64,8 +64,6 @@
 #include "nrf_log_default_backends.h"
 #include "nrf_log_backend_flash.h"
 
-extern void user_usb_init(void);
-
 #if defined(APP_USBD_ENABLED) && APP_USBD_ENABLED
 #define CLI_OVER_USB_CDC_ACM 1
 #else
@@ -79,6 +77,9 @@ extern void user_usb_init(void);
 #include "app_usbd.h"
 #include "app_usbd_string_desc.h"
 #include "app_usbd_cdc_acm.h"
+
+extern void user_usb_init(app_usbd_class_inst_t const * p_cli_class);
+extern void user_usb_reset(void);
 #endif //CLI_OVER_USB_CDC_ACM
 
 #if defined(TX_PIN_NUMBER) && defined(RX_PIN_NUMBER) && NRF_CLI_UART_ENABLED
@@ -145,7 +146,11 @@ static void usbd_user_ev_handler(app_usbd_event_type_t event)
 {
     switch (event)
     {
+        case APP_USBD_EVT_DRV_RESET:
+            user_usb_reset();
+            break;
         case APP_USBD_EVT_STOPPED:
+            user_usb_reset();
             app_usbd_disable();
             break;
         case APP_USBD_EVT_POWER_DETECTED:
@@ -155,6 +160,7 @@ static void usbd_user_ev_handler(app_usbd_event_type_t event)
             }
             break;
         case APP_USBD_EVT_POWER_REMOVED:
+            user_usb_reset();
             app_usbd_stop();
             break;
         case APP_USBD_EVT_POWER_READY:
@@ -243,12 +249,11 @@ static void usbd_init(void)
     ret = app_usbd_init(&usbd_config);
     APP_ERROR_CHECK(ret);
 
-    user_usb_init();
-
+    // The application appends the CLI's class along with its own, so
+    // that they all go in in interface number order.
     app_usbd_class_inst_t const * class_cdc_acm =
             app_usbd_cdc_acm_class_inst_get(&nrf_cli_cdc_acm);
-    ret = app_usbd_class_append(class_cdc_acm);
-    APP_ERROR_CHECK(ret);
+    user_usb_init(class_cdc_acm);
 
     if (USBD_POWER_DETECTION)
     {